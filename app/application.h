@@ -9,6 +9,10 @@
 #include <memory>
 #include "../tcp/server.h"
 #include "../tcp/client.h"
+#include "../tcp/clientpool.h"
+#include "../tcp/coro.h"
+#include "../tcp/relay.h"
+#include "../tcp/spscqueue.h"
 #include "device.h"
 
 namespace project {
@@ -25,8 +29,9 @@ class App
 
 	      /*
       	 * webcontrol server for old web client (2 button control)
+      	 * framed batches the messages forwarded downstream behind a 4-byte length prefix, the peer must decode it
 	       */
-        void startCtrl()
+        void startCtrl(const bool framed = false)
         {
             cout << "\n*** C++ IO-Control Project ***\n" << endl;
 
@@ -35,9 +40,87 @@ class App
 
             unique_ptr<Tcp::Server> server(new Tcp::Server);
             unique_ptr<Device:: ControlLogic> ControlModule(new  Device::ControlLogic);
-            unique_ptr<Tcp::Client> client(new Tcp::Client);
+            // warm downstream connections, reused across messages instead of connecting each time
+            // small control messages, so no Nagle and no delayed ACK on either side
+            Tcp::SocketOptions opts = Tcp::SocketOptions::LowLatency();
+            Tcp::ClientPool pool(8, chrono::seconds(60), opts);
 
-            server->createServer(serverport);
+            // intake -> processing -> forwarding, each stage on its own thread joined by bounded lock-free queues
+            // a slow downstream endpoint fills the queues instead of stalling intake from web clients
+            Tcp::SpscQueue<string> received(1024), forward(1024);
+
+            // process received data
+            thread process([&] ()
+            {
+                vector<string> batch;
+                while (!received.IsClosed() || !received.Empty()) {
+                    batch.clear();
+                    received.WaitBatch(batch, 64);
+                    for (auto &data : batch) {
+                        const string &msg = ControlModule->processData(data);
+                        TCP_LOG_INFO("device status: " << msg);
+                        forward.Push(move(data));
+                    }
+                }
+                forward.Close();
+            });
+
+            // send data to web client
+            // by default every message goes out in a send of its own, as the downstream peer expects raw messages
+            // with framed set, whatever queued up during the last send goes out in a single send and every message
+            // carries a 32-bit big-endian length prefix to keep its boundary (read them with Tcp::LengthCodec(Tcp::LengthCodec::Fixed32))
+            thread forwarder([&] ()
+            {
+                const Tcp::LengthCodec framing(Tcp::LengthCodec::Fixed32);
+                vector<string> batch;
+                while (!forward.IsClosed() || !forward.Empty()) {
+                    batch.clear();
+                    if (!forward.WaitBatch(batch, framed ? 64 : 1)) {
+                        continue;
+                    }
+                    string out;
+                    if (framed) {
+                        for (auto &data : batch) {
+                            framing.Encode(data.data(), data.size(), out);
+                        }
+                    }
+                    else {
+                        out = move(batch.front());
+                    }
+                    // tcp client from the pool, connects only if no healthy idle one is available
+                    // provide remote endpoint port and ip
+                    // if ip is not provided it will default to localhost
+                    // an unreachable endpoint fails within the connect timeout and the batch is dropped
+                    try
+                    {
+                      auto client = pool.Acquire(clientport);
+                      // a broken pooled connection is dropped instead of reused
+                      try
+                      {
+                        client->SendFuture(move(out)).get();
+                        TCP_LOG_INFO("data to web client: " << batch.size() << " message(s)");
+                      }
+                      catch (SocketError& e)
+                      {
+                        TCP_LOG_ERROR("forward error: " << e.what());
+                        client.Discard();
+                      }
+                    }
+                    catch (SocketError& e)
+                    {
+                      TCP_LOG_ERROR("downstream connect error: " << e.what());
+                    }
+                }
+            });
+
+            auto stopStages = [&] ()
+            {
+                received.Close();
+                process.join();
+                forwarder.join();
+            };
+
+            server->createServer(serverport, "127.0.0.1", opts);
             int loop = true;
             while(loop)
             {
@@ -48,20 +131,12 @@ class App
                     server->Listen(true);
                     // receive data from web client
                     string data = server->ReadAsync();
-                    cout << "data from web client: " << data << endl;
-                    // process received data
-                    string msg = ControlModule->processData(data);
-                    cout << "device status: " << msg << endl;
-                    // tcp client connecting to server
-                    // provide remote endpoint port and ip
-                    // if ip is not provided it will default to localhost
-                    client->Connect(clientport);
-                    // send data to web client
-                    client->SendAsync(data);
-                    // close client socket
-                    client->Close();
-                    cout << "data to web client: " << data << endl;
-                    cout << "waiting for new data ... \n\n";
+                    TCP_LOG_INFO("data from web client: " << data);
+                    // hand it to the processing stage, this only waits when both queues are full
+                    if (!data.empty()) {
+                        received.Push(move(data));
+                    }
+                    TCP_LOG_INFO("waiting for new data ...");
                     // close server socket
                     // since Listen(true) is set to continous loop, close operation will only close the newsockfd but not sockfd
                     server->Close();
@@ -71,14 +146,57 @@ class App
                     loop = false;
                     cerr << "error: " << e.what() << endl;
                     cout << "Please restart server." << endl;
+                    stopStages();
                     server.reset(nullptr);
                     exit(1);
                 }
             }
+         stopStages();
          server.reset(nullptr);
          exit(1);
         }
 
+	      /*
+      	 * pure forwarding from web clients to the downstream endpoint, payloads are spliced
+      	 * socket to socket through a pipe and never copied into the application
+	       */
+        void startRelay()
+        {
+            cout << "\n*** C++ IO-Control Relay ***\n" << endl;
+
+            int serverport = 51111;
+            int clientport = 5555;
+
+            unique_ptr<Tcp::Server> server(new Tcp::Server);
+            Tcp::ClientPool pool;
+            server->createServer(serverport);
+            while(true)
+            {
+                server->Listen(true);
+                try
+                {
+                    auto client = pool.Acquire(clientport);
+                    try
+                    {
+                        // until the web client closes, or 5 seconds pass without any data moving
+                        Tcp::Relay relay;
+                        uint64_t n = relay.Run(server->Fd(), client->Fd(), 5000);
+                        TCP_LOG_INFO("relayed " << n << " bytes" << (relay.Spliced() ? "" : " (copied)"));
+                    }
+                    catch (SocketError& e)
+                    {
+                        TCP_LOG_ERROR("relay error: " << e.what());
+                        client.Discard();
+                    }
+                }
+                catch (SocketError& e)
+                {
+                    TCP_LOG_ERROR("downstream connect error: " << e.what());
+                }
+                server->Close();
+            }
+        }
+
 	      /*
       	 * client/server communication and non-blocking read timeout test
 	       */
@@ -178,7 +296,8 @@ class App
             {
               try{
                 s->Listen(true);
-                cout << "received: " << s->SendAsync(s->ReadAsync()) << endl;
+                string data = s->SendAsync(s->ReadAsync());
+                TCP_LOG_INFO("received: " << data);
                 s->Close();
               }
               catch (SocketError& e)
@@ -189,6 +308,68 @@ class App
             }
 
        }
+
+	     /*
+        * echo server keeping many clients connected at once, one event loop per core
+	      */
+        void startEventEchoServer()
+        {
+            cout << "\n*** C++ IO-Control Event Loop Echo Server Demo ***\n" << endl;
+
+            Tcp::Server s(51111);
+
+            s.OnRead([] (Tcp::Connection& c)
+            {
+              string data = c.Read();
+              if (!data.empty()) {
+                c.Send(data);
+              }
+            });
+            s.Serve(thread::hardware_concurrency(), true);
+        }
+
+#ifdef TCP_HAVE_COROUTINES
+	     /*
+        * echo server written as sequential code, each client is a coroutine on one event loop (-std=c++20)
+	      */
+        static Tcp::Task<> echoSession(Tcp::AsyncSocket client)
+        {
+            for (;;)
+            {
+              string data = co_await client.Read();
+              if (data.empty()) {
+                break;
+              }
+              co_await client.Send(data);
+            }
+        }
+
+        static Tcp::Task<> acceptLoop(Tcp::AsyncListener& listener)
+        {
+            for (;;)
+            {
+              Tcp::Spawn(echoSession(co_await listener.Accept()));
+            }
+        }
+
+        void startCoroEchoServer()
+        {
+            cout << "\n*** C++ IO-Control Coroutine Echo Server Demo ***\n" << endl;
+
+            try
+            {
+              Tcp::EventLoop loop;
+              Tcp::AsyncListener listener(loop, 51111);
+              Tcp::Spawn(acceptLoop(listener));
+              loop.Run();
+            }
+            catch (SocketError& e)
+            {
+              cerr << "error: " << e.what() << endl;
+              exit(1);
+            }
+        }
+#endif
 };
 
 }
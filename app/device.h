@@ -5,66 +5,193 @@
 */
 
 #pragma once
+#include <stdint.h>
+#include <string.h>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+#include "../tcp/buffer.h"
 
 namespace Device {
 using namespace std;
 
-class ControlLogic
+// FNV-1a, constexpr so the command table below is hashed by the compiler
+constexpr uint32_t fnv1a(const char *s, const size_t n, const uint32_t h = 2166136261u)
+{
+    return n ? fnv1a(s + 1, n - 1, (h ^ static_cast<unsigned char>(*s)) * 16777619u) : h;
+}
+
+constexpr size_t length(const char *s)
+{
+    return *s ? 1 + length(s + 1) : 0;
+}
+
+// same hash for received data, a loop since the input can be long
+inline uint32_t hash(const char *s, const size_t n)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ static_cast<unsigned char>(s[i])) * 16777619u;
+    }
+    return h;
+}
+
+struct Command
+{
+    const char *code;
+    const char *response;
+    uint32_t hash;
+
+    constexpr Command(const char *code, const char *response) : code{code}, response{response}, hash{fnv1a(code, length(code))} {}
+};
+
+// built-in control codes
+constexpr Command commands[] = {
+    // device1
+    {"ON1", "Device1 is ON"}, {"OFF1", "Device1 is OFF"},
+    // device2
+    {"ON2", "Device2 is ON"}, {"OFF2", "Device2 is OFF"},
+    // device3
+    {"ON3", "Device3 is ON"}, {"OFF3", "Device3 is OFF"},
+    // device4
+    {"ON4", "Device4 is ON"}, {"OFF4", "Device4 is OFF"},
+    // device5
+    {"ON5", "Device5 is ON"}, {"OFF5", "Device5 is OFF"},
+    // device6
+    {"ON6", "Device6 is ON"}, {"OFF6", "Device6 is OFF"},
+};
+
+/*
+ * Command registry, open addressing on the FNV-1a hash with the table kept at most half full,
+ * so a lookup is one hash and usually one compare however many commands are registered.
+ * Responses are stored preformatted and returned by reference, they stay valid while the table lives.
+ */
+class CommandTable
 {
     public:
-        ControlLogic() {}
-        ~ControlLogic() {}
+        using Handler = function<void()>;
 
-        // control code operation
-        const string processData(string m)
+    private:
+        struct Entry
         {
-            string data;
+            string code;
+            string response;
+            Handler handler;
+            uint32_t hash;
+        };
 
-            // device1
-            if (m == "ON1"){
-                return data = "Device1 is ON";
-            }
-            else if(m == "OFF1"){
-                return data = "Device1 is OFF";
-            }
-            // device2
-            else if(m == "ON2"){
-                return data = "Device2 is ON";
-            }
-            else if(m == "OFF2"){
-                return data = "Device2 is OFF";
-            }
-            // device3
-            else if (m == "ON3"){
-                return data = "Device3 is ON";
+        deque<Entry> entries; // deque, so responses already handed out never move
+        vector<int> slots;    // index into entries, -1 when free
+        string unknown = "code not recognized";
+
+        int find(const char *code, const size_t len, const uint32_t h) const
+        {
+            if (slots.empty()) {
+                return -1;
             }
-            else if(m == "OFF3"){
-                return data = "Device3 is OFF";
+            size_t mask = slots.size() - 1;
+            for (size_t i = h & mask; slots[i] >= 0; i = (i + 1) & mask) {
+                const Entry &e = entries[slots[i]];
+                if (e.hash == h && e.code.size() == len && memcmp(e.code.data(), code, len) == 0) {
+                    return slots[i];
+                }
             }
-            // device4
-            else if (m == "ON4"){
-                return data = "Device4 is ON";
+            return -1;
+        }
+
+        void insert(const int index)
+        {
+            size_t mask = slots.size() - 1;
+            size_t i = entries[index].hash & mask;
+            while (slots[i] >= 0) {
+                i = (i + 1) & mask;
             }
-            else if(m == "OFF4"){
-                return data = "Device4 is OFF";
+            slots[i] = index;
+        }
+
+        void add(const string &code, const string &response, Handler handler, const uint32_t h)
+        {
+            int i = find(code.data(), code.size(), h);
+            if (i >= 0) {
+                entries[i].response = response;
+                entries[i].handler = move(handler);
+                return;
             }
-            // device5
-            else if(m == "ON5"){
-                return data = "Device5 is ON";
+            entries.push_back(Entry{code, response, move(handler), h});
+            if (entries.size() * 2 > slots.size()) {
+                slots.assign(slots.empty() ? 16 : slots.size() * 2, -1);
+                for (size_t n = 0; n < entries.size(); n++) {
+                    insert(n);
+                }
             }
-            else if(m == "OFF5"){
-                return data = "Device5 is OFF";
+            else {
+                insert(entries.size() - 1);
             }
-            // device6
-            else if(m == "ON6"){
-                return data = "Device6 is ON";
+        }
+
+    public:
+        // a code registered again replaces its response and handler
+        void Add(const string &code, const string &response, Handler handler = nullptr)
+        {
+            add(code, response, move(handler), hash(code.data(), code.size()));
+        }
+
+        void Add(const Command &c, Handler handler = nullptr)
+        {
+            add(c.code, c.response, move(handler), c.hash);
+        }
+
+        // response for codes that are not registered
+        void SetUnknown(const string &response) { unknown = response; }
+
+        bool Contains(Tcp::ConstBuffer code) const { return find(code.data, code.size, hash(code.data, code.size)) >= 0; }
+
+        size_t Size() const { return entries.size(); }
+
+        // run the handler of code and return its response, nothing is allocated
+        const string& Dispatch(Tcp::ConstBuffer code) const
+        {
+            int i = find(code.data, code.size, hash(code.data, code.size));
+            if (i < 0) {
+                return unknown;
             }
-            else if(m == "OFF6"){
-                return data = "Device6 is OFF";
+            const Entry &e = entries[i];
+            if (e.handler) {
+                e.handler();
             }
-            else
-                return data = "code not recognized";
+            return e.response;
+        }
+};
+
+class ControlLogic
+{
+    CommandTable table;
+
+    public:
+        ControlLogic()
+        {
+            for (const Command &c : commands) {
+                table.Add(c);
             }
-       };
+        }
+        ~ControlLogic() {}
+
+        // register ON<n>/OFF<n> for another device, handlers switch the actual hardware
+        void AddDevice(const int n, CommandTable::Handler on = nullptr, CommandTable::Handler off = nullptr)
+        {
+            string id = to_string(n);
+            table.Add("ON" + id, "Device" + id + " is ON", move(on));
+            table.Add("OFF" + id, "Device" + id + " is OFF", move(off));
+        }
+
+        CommandTable& Commands() { return table; }
+
+        // control code operation, accepts a string or any pointer and length
+        const string& processData(Tcp::ConstBuffer m) const
+        {
+            return table.Dispatch(m);
+        }
+};
 
 }
@@ -0,0 +1,416 @@
+/*
+ * Source File: echobench.cpp
+ * Author: Ed Alegrid
+ * Copyright (c) 2017 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ *
+ * Loopback echo benchmark, the server and the load generator run in one process.
+ *
+ *   $ g++ -O2 -std=c++11 bench/echobench.cpp -o bin/echobench -pthread
+ *   $ ./bin/echobench --mode epoll --conns 64 --size 64 --depth 8 --duration 5
+ *
+ * Modes:
+ *   legacy   Listen(true)/ReadAsync()/SendAsync()/Close(), one message per connection as in startEchoServer()
+ *   epoll    Serve() with OnRead echo
+ *   uring    Serve() with the io_uring backend, falls back to epoll without kernel support
+ *   coro     AsyncListener/AsyncSocket coroutines on one event loop (build with -std=c++20)
+ *
+ * --unix unix:/path or unix:@name runs the legacy, epoll and uring modes over a Unix domain socket
+ * instead of loopback TCP.
+ *
+ * Reports messages/s, MB/s (echoed payload), p50/p99/p999 round trip latency, the load generator's
+ * syscalls per message and process CPU time per message. Server syscalls can be counted with
+ * strace -c -f or perf trace -s.
+ */
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../tcp/server.h"
+#include "../tcp/coro.h"
+
+using namespace std;
+
+namespace {
+
+using Clock = chrono::steady_clock;
+
+struct Options
+{
+  string mode = "epoll";
+  int port = 52999;
+  string host = "127.0.0.1"; // or a "unix:" endpoint
+  int conns = 64;
+  size_t size = 64;
+  int depth = 1;
+  double duration = 5;
+  unsigned serverThreads = 1;
+  unsigned clientThreads = 2;
+};
+
+struct Stats
+{
+  uint64_t msgs = 0;
+  uint64_t syscalls = 0;
+  vector<uint32_t> latency; // microseconds
+};
+
+void usage()
+{
+  cerr << "usage: echobench [--mode legacy|epoll|uring|coro] [--port n] [--unix endpoint] [--conns n]\n"
+          "                 [--size bytes] [--depth n] [--duration sec] [--server-threads n] [--client-threads n]\n";
+  exit(2);
+}
+
+Options parse(int argc, char **argv)
+{
+  Options o;
+  for (int i = 1; i < argc; i++) {
+    string a = argv[i];
+    if (i + 1 >= argc) {
+      usage();
+    }
+    string v = argv[++i];
+    if (a == "--mode") o.mode = v;
+    else if (a == "--port") o.port = atoi(v.c_str());
+    else if (a == "--unix") o.host = v;
+    else if (a == "--conns") o.conns = max(1, atoi(v.c_str()));
+    else if (a == "--size") o.size = max(1, atoi(v.c_str()));
+    else if (a == "--depth") o.depth = max(1, atoi(v.c_str()));
+    else if (a == "--duration") o.duration = atof(v.c_str());
+    else if (a == "--server-threads") o.serverThreads = max(1, atoi(v.c_str()));
+    else if (a == "--client-threads") o.clientThreads = max(1, atoi(v.c_str()));
+    else usage();
+  }
+  return o;
+}
+
+int connectTo(const Options &o)
+{
+  Tcp::Address a;
+  if (!Tcp::Address::Unix(o.host, a)) {
+    sockaddr_in *in = reinterpret_cast<sockaddr_in*>(&a.addr);
+    in->sin_family = AF_INET;
+    in->sin_port = htons(o.port);
+    inet_pton(AF_INET, o.host.c_str(), &in->sin_addr);
+    a.len = sizeof(sockaddr_in);
+  }
+  for (int attempt = 0; attempt < 100; attempt++) {
+    int fd = socket(a.Family(), SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *) &a.addr, a.len) == 0) {
+      int on = 1;
+      if (a.Family() != AF_UNIX) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+      }
+      return fd;
+    }
+    close(fd);
+    // the server thread may still be starting
+    this_thread::sleep_for(chrono::milliseconds(10));
+  }
+  throw SocketError();
+}
+
+uint32_t micros(const Clock::time_point from, const Clock::time_point to)
+{
+  return static_cast<uint32_t>(chrono::duration_cast<chrono::microseconds>(to - from).count());
+}
+
+struct Start
+{
+  atomic<unsigned> ready{0};
+  atomic<bool> go{false};
+  Clock::time_point end;
+
+  // every driver connects first, so handshakes are not part of the measured run
+  Clock::time_point wait()
+  {
+    ready++;
+    while (!go) {
+      this_thread::yield();
+    }
+    return end;
+  }
+};
+
+/*
+ * Keeps depth messages in flight on each of its connections. The echo is a byte stream, so a message
+ * counts as answered once another size bytes have come back.
+ */
+void drive(const Options &o, const int conns, Start &start, Stats &st)
+{
+  struct Conn
+  {
+    int fd;
+    size_t partial;
+    deque<Clock::time_point> sent;
+  };
+  vector<Conn> cs(conns);
+  string payload(o.size * o.depth, 'x');
+  vector<char> buf(max<size_t>(65536, o.size * o.depth));
+  int ep = epoll_create1(0);
+  for (int i = 0; i < conns; i++) {
+    cs[i].fd = connectTo(o);
+    cs[i].partial = 0;
+    epoll_event e{};
+    e.events = EPOLLIN;
+    e.data.u32 = i;
+    epoll_ctl(ep, EPOLL_CTL_ADD, cs[i].fd, &e);
+  }
+  st.latency.reserve(1 << 20);
+  const Clock::time_point end = start.wait();
+
+  auto sendN = [&] (Conn &c, const int n)
+  {
+    auto now = Clock::now();
+    size_t len = o.size * n, off = 0;
+    while (off < len) {
+      ssize_t r = send(c.fd, payload.data() + off, len - off, MSG_NOSIGNAL);
+      st.syscalls++;
+      if (r <= 0) {
+        throw SocketError();
+      }
+      off += r;
+    }
+    for (int i = 0; i < n; i++) {
+      c.sent.push_back(now);
+    }
+  };
+
+  for (auto &c : cs) {
+    sendN(c, o.depth);
+  }
+  vector<epoll_event> events(conns);
+  while (Clock::now() < end) {
+    int n = epoll_wait(ep, events.data(), conns, 100);
+    st.syscalls++;
+    for (int i = 0; i < n; i++) {
+      Conn &c = cs[events[i].data.u32];
+      ssize_t r = recv(c.fd, buf.data(), buf.size(), MSG_DONTWAIT);
+      st.syscalls++;
+      if (r <= 0) {
+        if (r < 0 && errno == EAGAIN) {
+          continue;
+        }
+        throw SocketError("Server closed a benchmark connection");
+      }
+      c.partial += r;
+      auto now = Clock::now();
+      int done = 0;
+      while (c.partial >= o.size && !c.sent.empty()) {
+        c.partial -= o.size;
+        st.latency.push_back(micros(c.sent.front(), now));
+        c.sent.pop_front();
+        done++;
+      }
+      st.msgs += done;
+      if (done) {
+        sendN(c, done);
+      }
+    }
+  }
+  for (auto &c : cs) {
+    close(c.fd);
+  }
+  close(ep);
+}
+
+// the legacy server answers one message per connection, so every message pays a connect and a close
+void driveLegacy(const Options &o, Start &start, Stats &st)
+{
+  string payload(o.size, 'x');
+  vector<char> buf(o.size);
+  st.latency.reserve(1 << 20);
+  const Clock::time_point end = start.wait();
+  while (Clock::now() < end) {
+    auto t0 = Clock::now();
+    int fd = connectTo(o);
+    send(fd, payload.data(), payload.size(), MSG_NOSIGNAL);
+    size_t got = 0;
+    while (got < o.size) {
+      ssize_t r = recv(fd, buf.data(), buf.size(), 0);
+      st.syscalls++;
+      if (r <= 0) {
+        break;
+      }
+      got += r;
+    }
+    close(fd);
+    // socket, setsockopt, connect, send and close
+    st.syscalls += 5;
+    if (got == o.size) {
+      st.latency.push_back(micros(t0, Clock::now()));
+      st.msgs++;
+    }
+  }
+}
+
+#ifdef TCP_HAVE_COROUTINES
+Tcp::Task<> coroSession(Tcp::AsyncSocket s)
+{
+  vector<char> buf(65536);
+  for (;;) {
+    size_t n = co_await s.Read(Tcp::MutableBuffer(buf));
+    if (!n) {
+      break;
+    }
+    co_await s.Send(Tcp::ConstBuffer(buf.data(), n));
+  }
+}
+
+Tcp::Task<> coroAccept(Tcp::AsyncListener &l)
+{
+  for (;;) {
+    Tcp::Spawn(coroSession(co_await l.Accept()));
+  }
+}
+#endif
+
+double cpuSeconds()
+{
+  rusage ru{};
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+  Options o = parse(argc, argv);
+  if (o.mode == "legacy") {
+    o.conns = 1;
+    o.depth = 1;
+    o.clientThreads = 1;
+    o.size = min<size_t>(o.size, 1024); // ReadAsync() reads at most 1024 bytes
+  }
+
+  // the server runs on its own threads for the whole process, it is torn down by exiting
+  auto fail = [] (SocketError &e)
+  {
+    cerr << "benchmark error: " << e.what() << endl;
+    _exit(1);
+  };
+  if (o.mode == "legacy") {
+    thread([&o, fail] {
+      try
+      {
+        Tcp::Server s(o.port, o.host);
+        for (;;) {
+          s.Listen(true);
+          s.SendAsync(s.ReadAsync());
+          s.Close();
+        }
+      }
+      catch (SocketError& e) { fail(e); }
+    }).detach();
+  }
+  else if (o.mode == "epoll" || o.mode == "uring") {
+    thread([&o, fail] {
+      try
+      {
+        Tcp::Server s(o.port, o.host);
+        if (o.mode == "uring") {
+          s.SetBackend(Tcp::Server::IoUring);
+        }
+        s.OnRead([] (Tcp::Connection &c)
+        {
+          char buf[65536];
+          ssize_t n;
+          while ((n = c.Read(buf, sizeof buf)) > 0) {
+            c.Send(buf, n);
+          }
+        });
+        s.Serve(o.serverThreads);
+      }
+      catch (SocketError& e) { fail(e); }
+    }).detach();
+  }
+#ifdef TCP_HAVE_COROUTINES
+  else if (o.mode == "coro" && !Tcp::Address::IsUnix(o.host)) {
+    thread([&o, fail] {
+      try
+      {
+        Tcp::EventLoop loop;
+        Tcp::AsyncListener l(loop, o.port, "127.0.0.1");
+        Tcp::Spawn(coroAccept(l));
+        loop.Run();
+      }
+      catch (SocketError& e) { fail(e); }
+    }).detach();
+  }
+#endif
+  else {
+    cerr << "mode " << o.mode << " is not available in this build\n";
+    return 2;
+  }
+
+  const unsigned nthreads = min<unsigned>(o.clientThreads, o.conns);
+  vector<Stats> stats(nthreads);
+  vector<thread> drivers;
+  // give the server a moment to bind before the drivers connect
+  this_thread::sleep_for(chrono::milliseconds(200));
+  Start gate;
+  for (unsigned i = 0; i < nthreads; i++) {
+    int conns = o.conns / nthreads + (i < o.conns % nthreads ? 1 : 0);
+    drivers.emplace_back([&, i, conns] {
+      try
+      {
+        if (o.mode == "legacy") {
+          driveLegacy(o, gate, stats[i]);
+        }
+        else {
+          drive(o, conns, gate, stats[i]);
+        }
+      }
+      catch (SocketError& e) { fail(e); }
+    });
+  }
+  while (gate.ready < nthreads) {
+    this_thread::sleep_for(chrono::milliseconds(1));
+  }
+  double cpu0 = cpuSeconds();
+  auto start = Clock::now();
+  gate.end = start + chrono::milliseconds(static_cast<long>(o.duration * 1000));
+  gate.go = true;
+  for (auto &d : drivers) {
+    d.join();
+  }
+  double secs = chrono::duration<double>(Clock::now() - start).count();
+  double cpu = cpuSeconds() - cpu0;
+
+  Stats total;
+  for (auto &s : stats) {
+    total.msgs += s.msgs;
+    total.syscalls += s.syscalls;
+    total.latency.insert(total.latency.end(), s.latency.begin(), s.latency.end());
+  }
+  if (!total.msgs) {
+    cerr << "no messages were echoed\n";
+    return 1;
+  }
+  sort(total.latency.begin(), total.latency.end());
+  auto pct = [&total] (const double p) { return total.latency[min(total.latency.size() - 1, size_t(p * total.latency.size()))]; };
+
+  printf("mode=%s conns=%d size=%zu depth=%d server-threads=%u client-threads=%u duration=%.1fs\n",
+         o.mode.c_str(), o.conns, o.size, o.depth, o.serverThreads, nthreads, secs);
+  printf("  %.0f msgs/s  %.2f MB/s\n", total.msgs / secs, total.msgs * o.size / secs / 1e6);
+  printf("  latency us  p50=%u  p99=%u  p999=%u  max=%u\n", pct(0.5), pct(0.99), pct(0.999), total.latency.back());
+  printf("  client syscalls/msg=%.2f  cpu us/msg=%.2f\n", double(total.syscalls) / total.msgs, cpu * 1e6 / total.msgs);
+  fflush(stdout);
+  _exit(0);
+}
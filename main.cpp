@@ -20,9 +20,12 @@ int main()
 
     /* run and test each method one at a time */
     //app->startCtrl(); // for 2 button web client only
+    //app->startRelay(); // forward web clients to port 5555 with splice()
     //app->startTest();
     //app->startOtherTest();
     app->startEchoServer();
+    //app->startEventEchoServer(); // many concurrent clients on one epoll loop
+    //app->startCoroEchoServer(); // coroutine per client, build with -std=c++20
 
    return 0;
 }
@@ -0,0 +1,395 @@
+/*
+ * Source File: asyncio.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2017 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "eventloop.h"
+#include "ringbuffer.h"
+#include "recvbuffer.h"
+#include "result.h"
+#include "zerocopy.h"
+
+namespace Tcp {
+
+using namespace std;
+
+/*
+ * One event loop thread shared by the futures of every Server and Client, started by the first of them.
+ * A pending read or send waits in epoll here instead of holding a thread in poll().
+ */
+class IoLoop
+{
+  static const int SweepMs = 100;
+
+  EventLoop loop;
+  TimerWheel::Timer sweep;
+  thread worker;
+
+  IoLoop() : sweep([this] { if (ZeroCopy::Sweep()) loop.Timers().Schedule(sweep, SweepMs); }), worker([this] { loop.Run(); }) {}
+
+  public:
+    IoLoop(const IoLoop&) = delete;
+    IoLoop& operator=(const IoLoop&) = delete;
+
+    EventLoop& Loop() { return loop; }
+    bool OnLoop() const { return this_thread::get_id() == worker.get_id(); }
+
+    // run t on the loop thread and wait for it, inline when already there
+    void Call(const EventLoop::Task &t)
+    {
+      if (OnLoop()) {
+        t();
+        return;
+      }
+      promise<void> done;
+      loop.Post([&t, &done] { t(); done.set_value(); });
+      done.get_future().wait();
+    }
+
+    // thread-safe, call when ZeroCopy::Retire() kept a socket open, it is closed once its buffers are released
+    void SweepRetired()
+    {
+      loop.Post([this]
+      {
+        if (!sweep.Armed()) {
+          loop.Timers().Schedule(sweep, SweepMs);
+        }
+      });
+    }
+
+    // never destroyed, objects released during exit may still detach from it
+    static IoLoop& Default()
+    {
+      static IoLoop *l = new IoLoop;
+      return *l;
+    }
+};
+
+/*
+ * Readiness driven SendFuture()/ReadFuture() of a Server or Client connection. Sends complete in call
+ * order, and so do reads; each one is tried right away and otherwise resumed by the next edge
+ * of its socket on the IoLoop, bounded by its own timeout.
+ * The blocking calls use the same outbound queue and receive buffer, so the two APIs take turns per
+ * direction: a Blocking guard waits for the pending operations and the ones submitted meanwhile
+ * start after it is released.
+ */
+class AsyncIo
+{
+  public:
+    enum Direction { Sending, Reading };
+    using SendDone = function<void(IoResult)>;
+    using ReadDone = function<void(IoResult, string)>;
+
+  private:
+    struct SendOp
+    {
+      int fd;
+      shared_ptr<const string> msg;
+      int timeout;
+      SendDone done;
+      size_t off;
+    };
+
+    struct ReadOp
+    {
+      int fd;
+      size_t bufsize;
+      int timeout;
+      ReadDone done;
+    };
+
+    // blocking calls and pending operations of one direction
+    struct Turn
+    {
+      mutex m;
+      condition_variable cv;
+      size_t pending = 0;
+      thread::id owner;
+      int depth = 0;
+    };
+
+    RingBuffer &out;
+    RecvBuffer &in;
+    ZeroCopy &zc;
+    function<ssize_t(ssize_t)> sent;
+    function<ssize_t(string&)> drain;
+    Turn turns[2];
+    atomic<bool> used{false};
+
+    // loop thread only
+    deque<SendOp> sends;
+    deque<ReadOp> reads;
+    int watched = -1;
+    TimerWheel::Timer sendTimer, readTimer;
+
+    EventLoop& loop() { return IoLoop::Default().Loop(); }
+
+    bool blocked(const Direction d)
+    {
+      lock_guard<mutex> lk(turns[d].m);
+      return turns[d].depth > 0;
+    }
+
+    void submitted(const Direction d)
+    {
+      used = true;
+      lock_guard<mutex> lk(turns[d].m);
+      turns[d].pending++;
+    }
+
+    // the pending count drops before done runs, so a caller woken by it can block right away
+    void finished(const Direction d)
+    {
+      {
+        lock_guard<mutex> lk(turns[d].m);
+        turns[d].pending--;
+      }
+      turns[d].cv.notify_all();
+    }
+
+    // edge-triggered on the socket of the first pending operation, both directions share it
+    void watch(const int fd)
+    {
+      if (fd == watched) {
+        return;
+      }
+      unwatch();
+      loop().Add(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, [this] (uint32_t ev)
+      {
+        if ((ev & EPOLLERR) && zc.Used() && !sends.empty() && !blocked(Sending)) {
+          zc.Reap(watched);
+        }
+        pump();
+      });
+      watched = fd;
+    }
+
+    void unwatch()
+    {
+      if (watched >= 0) {
+        loop().Remove(watched);
+        watched = -1;
+      }
+    }
+
+    void sendDone(const IoResult r)
+    {
+      SendOp op = move(sends.front());
+      sends.pop_front();
+      sendTimer.Cancel();
+      finished(Sending);
+      op.done(r);
+    }
+
+    void readDone(const IoResult r, string s)
+    {
+      ReadOp op = move(reads.front());
+      reads.pop_front();
+      readTimer.Cancel();
+      finished(Reading);
+      op.done(r, move(s));
+    }
+
+    // write the head sends until the socket would block, leftovers of a blocking Send go first
+    void pumpSends()
+    {
+      while (!sends.empty() && !blocked(Sending)) {
+        SendOp &op = sends.front();
+        const string &m = *op.msg;
+        ssize_t n = 0;
+        if (op.off < m.size()) {
+          if (zc.Wants(m.size()) && out.Empty()) {
+            n = sent(zc.Send(op.fd, op.msg, m.data() + op.off, m.size() - op.off));
+            if (n > 0) {
+              op.off += n;
+            }
+          }
+          else {
+            if (zc.Used()) {
+              zc.Reap(op.fd);
+            }
+            n = sent(out.WriteTo(op.fd, m.data() + op.off, m.size() - op.off));
+            if (n >= 0) {
+              op.off = m.size();
+            }
+          }
+        }
+        else if (!out.Empty()) {
+          n = sent(out.WriteTo(op.fd));
+        }
+        if (n < 0) {
+          sendDone(IoResult::FromErrno(errno));
+          continue;
+        }
+        if (op.off == m.size() && out.Empty()) {
+          sendDone(IoResult(IoResult::Ok, m.size()));
+          continue;
+        }
+        if (!n) {
+          // wait for the next edge, adding the socket reports it right away if it is writable by now
+          watch(op.fd);
+          if (op.timeout >= 0 && !sendTimer.Armed()) {
+            loop().Timers().Schedule(sendTimer, op.timeout);
+          }
+          return;
+        }
+      }
+    }
+
+    // receive for the head reads until the socket would block
+    void pumpReads()
+    {
+      while (!reads.empty() && !blocked(Reading)) {
+        ReadOp &op = reads.front();
+        string s;
+        in.Reserve(op.bufsize);
+        ssize_t n = drain(s);
+        if (!s.empty()) {
+          readDone(IoResult(IoResult::Ok, s.size()), move(s));
+          continue;
+        }
+        if (n == 0) {
+          readDone(IoResult(IoResult::Closed), string());
+          continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          readDone(IoResult::FromErrno(errno), string());
+          continue;
+        }
+        if (!op.timeout) {
+          readDone(IoResult(IoResult::Timeout), string());
+          continue;
+        }
+        watch(op.fd);
+        if (op.timeout > 0 && !readTimer.Armed()) {
+          loop().Timers().Schedule(readTimer, op.timeout);
+        }
+        return;
+      }
+    }
+
+    // the socket stays watched only while operations are pending, blocking calls cause no wake-ups
+    void pump()
+    {
+      pumpSends();
+      pumpReads();
+      if (sends.empty() && reads.empty()) {
+        unwatch();
+      }
+    }
+
+    // fail everything still pending and forget the socket, loop thread only
+    void detach()
+    {
+      while (!sends.empty()) {
+        sendDone(IoResult(IoResult::Error, 0, ECANCELED));
+      }
+      while (!reads.empty()) {
+        readDone(IoResult(IoResult::Closed), string());
+      }
+      unwatch();
+    }
+
+  public:
+    AsyncIo(RingBuffer &out, RecvBuffer &in, ZeroCopy &zc, function<ssize_t(ssize_t)> sent, function<ssize_t(string&)> drain)
+      : out(out), in(in), zc(zc), sent{move(sent)}, drain{move(drain)},
+        sendTimer([this] { sendDone(IoResult(IoResult::Timeout)); pump(); }),
+        readTimer([this] { readDone(IoResult(IoResult::Timeout), string()); pump(); }) {}
+    AsyncIo(const AsyncIo&) = delete;
+    AsyncIo& operator=(const AsyncIo&) = delete;
+
+    ~AsyncIo() { Detach(); }
+
+    // held by a blocking call for its whole duration, reentrant on the same thread
+    class Blocking
+    {
+      AsyncIo &io;
+      Direction d;
+
+      public:
+        Blocking(AsyncIo &io, const Direction d) : io(io), d{d}
+        {
+          Turn &t = io.turns[d];
+          unique_lock<mutex> lk(t.m);
+          if (t.depth && t.owner == this_thread::get_id()) {
+            t.depth++;
+            return;
+          }
+          t.cv.wait(lk, [&t] { return !t.depth && !t.pending; });
+          t.owner = this_thread::get_id();
+          t.depth = 1;
+        }
+        Blocking(const Blocking&) = delete;
+        Blocking& operator=(const Blocking&) = delete;
+
+        ~Blocking()
+        {
+          Turn &t = io.turns[d];
+          bool resume;
+          {
+            lock_guard<mutex> lk(t.m);
+            if (--t.depth) {
+              return;
+            }
+            resume = t.pending > 0;
+          }
+          t.cv.notify_all();
+          if (resume) {
+            AsyncIo *p = &io;
+            IoLoop::Default().Loop().Post([p] { p->pump(); });
+          }
+        }
+    };
+
+    // send all of msg on fd, done(Ok with the bytes, Timeout when it is not written within timeout ms, or the error)
+    // runs on the loop thread and must not block
+    void Send(const int fd, shared_ptr<const string> msg, const int timeout, SendDone done)
+    {
+      submitted(Sending);
+      auto op = make_shared<SendOp>(SendOp{fd, move(msg), timeout, move(done), 0});
+      loop().Post([this, op]
+      {
+        sends.push_back(move(*op));
+        if (sends.size() == 1) {
+          pump();
+        }
+      });
+    }
+
+    // receive what is available on fd once it is readable, done(Ok with the data, Timeout, Closed or the error)
+    void Read(const int fd, const size_t bufsize, const int timeout, ReadDone done)
+    {
+      submitted(Reading);
+      auto op = make_shared<ReadOp>(ReadOp{fd, bufsize ? bufsize : 1, timeout, move(done)});
+      loop().Post([this, op]
+      {
+        reads.push_back(move(*op));
+        if (reads.size() == 1) {
+          pump();
+        }
+      });
+    }
+
+    // before the socket is closed or replaced: pending sends fail with ECANCELED, reads end as Closed
+    void Detach()
+    {
+      if (used) {
+        IoLoop::Default().Call([this] { detach(); });
+      }
+    }
+};
+
+}
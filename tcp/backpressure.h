@@ -0,0 +1,82 @@
+/*
+ * Source File: backpressure.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2017 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <stddef.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+namespace Tcp {
+
+using namespace std;
+
+/*
+ * Byte count of SendFuture()/SendAsync() payloads queued but not written yet, with high/low watermarks.
+ * They wait in the connection's ring-buffer outbound queue, flushed on EPOLLOUT from the IoLoop.
+ * A producer that finds the count at the high watermark waits in Acquire() until the sends
+ * drained it down to the low watermark, so memory stays bounded by roughly high plus one message.
+ */
+class Backpressure
+{
+  mutable mutex m;
+  condition_variable cv;
+  size_t queued = 0, high = 0, low = 0;
+  bool blocked = false;
+
+  public:
+    Backpressure() {}
+    Backpressure(const Backpressure&) = delete;
+    Backpressure& operator=(const Backpressure&) = delete;
+
+    // 0 turns the limit off, a low watermark not below high is taken as half of high
+    void Set(const size_t h, const size_t l)
+    {
+      lock_guard<mutex> lk(m);
+      high = h;
+      low = l < h ? l : h / 2;
+      blocked = false;
+      cv.notify_all();
+    }
+
+    size_t Queued() const
+    {
+      lock_guard<mutex> lk(m);
+      return queued;
+    }
+
+    // account for n more bytes, waiting up to timeout ms (-1 forever) while above the watermarks
+    // false on timeout, nothing is accounted then
+    bool Acquire(const size_t n, const int timeout = -1)
+    {
+      unique_lock<mutex> lk(m);
+      if (high && (blocked || queued >= high)) {
+        blocked = true;
+        auto drained = [this] { return !high || queued <= low; };
+        if (timeout < 0) {
+          cv.wait(lk, drained);
+        }
+        else if (!cv.wait_for(lk, chrono::milliseconds(timeout), drained)) {
+          return false;
+        }
+        blocked = false;
+      }
+      queued += n;
+      return true;
+    }
+
+    // n bytes were written or dropped
+    void Release(const size_t n)
+    {
+      lock_guard<mutex> lk(m);
+      queued = n < queued ? queued - n : 0;
+      if (blocked && queued <= low) {
+        cv.notify_all();
+      }
+    }
+};
+
+}
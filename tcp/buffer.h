@@ -0,0 +1,44 @@
+/*
+ * Source File: buffer.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2017 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+namespace Tcp {
+
+using namespace std;
+
+/*
+ * Non-owning pointer + length views over caller owned memory, used by the binary-safe
+ * Read/Send overloads. The memory must outlive the call.
+ */
+struct MutableBuffer
+{
+  char *data;
+  size_t size;
+
+  MutableBuffer(char *data, const size_t size) : data{data}, size{size} {}
+  template <size_t N>
+  MutableBuffer(char (&a)[N]) : data{a}, size{N} {}
+  // uses the current size of the string, resize() it first
+  MutableBuffer(string &s) : data{&s[0]}, size{s.size()} {}
+  MutableBuffer(vector<char> &v) : data{v.data()}, size{v.size()} {}
+};
+
+struct ConstBuffer
+{
+  const char *data;
+  size_t size;
+
+  ConstBuffer(const char *data, const size_t size) : data{data}, size{size} {}
+  ConstBuffer(const string &s) : data{s.data()}, size{s.size()} {}
+  ConstBuffer(const vector<char> &v) : data{v.data()}, size{v.size()} {}
+  ConstBuffer(const MutableBuffer &b) : data{b.data}, size{b.size} {}
+};
+
+}
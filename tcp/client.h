@@ -12,8 +12,22 @@
 #include <sys/poll.h>
 #include <arpa/inet.h>
 #include <sstream>
+#include <chrono>
 #include <netdb.h>
 #include "socketerror.h"
+#include "buffer.h"
+#include "ringbuffer.h"
+#include "recvbuffer.h"
+#include "codec.h"
+#include "executor.h"
+#include "asyncio.h"
+#include "logger.h"
+#include "metrics.h"
+#include "socketoptions.h"
+#include "resolver.h"
+#include "result.h"
+#include "backpressure.h"
+#include "zerocopy.h"
 
 namespace Tcp {
 
@@ -21,73 +35,147 @@ using namespace std;
 
 class Client
 {
-    int sockfd, rv, rd;
-    char s[INET6_ADDRSTRLEN];
+    mutable int sockfd = -1; // reset by Close(), so a later Connect() never closes a reused fd number
+    int rv, rd;
     struct pollfd rs[1];
+    mutable RingBuffer outbuf;
+    RecvBuffer inbuf;
+    int sendTimeout = 5000;
+    int pollTimeout = 10; // how long Read/ReadAsync wait for data, see SetPollTimeout()
+    int connectTimeout = 5000;
+    mutable Metrics metrics;
+    SocketOptions opts;
+    // when the last request was fully sent, steady clock ticks, 0 if no response is pending
+    mutable atomic<int64_t> requestAt{0};
+    // bytes handed to SendFuture()/SendAsync() and not written yet, see SetSendWatermarks()
+    mutable Backpressure pressure;
+    // MSG_ZEROCOPY for large SendFuture()/SendAsync() payloads, see EnableZeroCopy()
+    size_t zeroCopyMin = 0;
+    mutable ZeroCopy zc;
+    // futures driven by the I/O loop, declared last so it detaches before the members it uses are destroyed
+    mutable AsyncIo aio{outbuf, inbuf, zc, [this] (const ssize_t n) { return sent(n); }, [this] (string &s) { return drain(s); }};
 
-    void *get_addr(struct sockaddr *sa)
-    {
-      if (sa->sa_family == AF_INET) {
-        return &(((struct sockaddr_in*)sa)->sin_addr);
-      }
-      return &(((struct sockaddr_in6*)sa)->sin6_addr);
-    }
-
+    // resolve through the cache and connect without blocking past connectTimeout, racing every address
+    // of the host, a failure is thrown as SocketError instead of ending the process
     int initSocket(int port, string ip)
     {
-      string PORT;
-      stringstream out;
-      out << port;
-      PORT = out.str();
-
-      addrinfo hints{};
-      hints.ai_family = AF_UNSPEC;
-      hints.ai_socktype = SOCK_STREAM;
-      addrinfo *servinfo{};
-
       try{
-        if (port <= 0){
+        if (port <= 0 && !Address::IsUnix(ip)){
+          errno = EINVAL;
           throw SocketError("Invalid port");
         }
-        if ((rv = getaddrinfo(ip.c_str(), PORT.c_str(), &hints, &servinfo)) != 0) {
-          cout << "getaddrinfo: " << gai_strerror(rv) << endl;
-          throw SocketError("Invalid address");
+        Close();
+        Address peer;
+        sockfd = Resolver::Default().Connect(ip, port, connectTimeout, opts, &peer);
+        // initial client console output, provide one in your application
+        if (peer.Family() == AF_UNIX) {
+          TCP_LOG_INFO("Client connected to: " << peer.Host());
         }
-        sockfd = {socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol)};
-        int result{ connect(sockfd, servinfo->ai_addr, servinfo->ai_addrlen)};
-          if (result < 0)
-          {
-            cout << "Client connection failed!" << endl;
-            throw SocketError();
-          }
-          else
-          {
-          // details of remote connected endpoint
-          inet_ntop(servinfo->ai_family, get_addr((struct sockaddr *)servinfo->ai_addr), s, sizeof s);
-          // initial client console output, provide one in your application
-          cout << "Client connected to: " << s << ":" << port << endl; 
-          }
-          if (servinfo == nullptr) {
-            throw SocketError("Client connect fail ...");
-          }
-
-          freeaddrinfo(servinfo);
-
-          if (fcntl(sockfd, F_SETFL, O_NONBLOCK) < 0){ throw SocketError();}
+        else {
+          TCP_LOG_INFO("Client connected to: " << peer.Host() << ":" << port);
+        }
+        opts.Apply(sockfd);
 
-          rs[0].fd = sockfd;
-          rs[0].events = POLLIN | POLLPRI;
+        outbuf.Clear();
+        inbuf.Shrink();
+        if (zeroCopyMin) {
+          zc.Enable(sockfd, zeroCopyMin);
+        }
+        rs[0].fd = sockfd;
+        rs[0].events = POLLIN | POLLPRI;
 
         return 0;
       }
       catch (SocketError& e)
       {
-        cerr << "Client Socket Initialize Error: " << e.what() << endl;
-        closeHandler();
-        exit(1);
+        int err = errno;
+        TCP_LOG_ERROR("Client Socket Initialize Error: " << e.what());
+        sockfd = -1;
+        errno = err;
+        throw;
+      }
+    }
+
+    // count one send, the service time starts once the request has been fully written
+    ssize_t sent(const ssize_t n) const
+    {
+      metrics.Sent(n, outbuf.Size());
+      if (n >= 0 && outbuf.Empty()) {
+        requestAt.store(chrono::steady_clock::now().time_since_epoch().count(), memory_order_relaxed);
+      }
+      return n;
+    }
+
+    // the first data after a request ends its service time
+    void replied() const
+    {
+      opts.Rearm(sockfd);
+      int64_t at = requestAt.exchange(0, memory_order_relaxed);
+      if (at) {
+        metrics.Service(chrono::steady_clock::time_point(chrono::steady_clock::duration(at)));
+      }
+    }
+
+    // count one recv
+    void received(const ssize_t n) const
+    {
+      metrics.Received(n);
+      if (n > 0) {
+        replied();
+      }
+    }
+
+    // an asynchronous send that did not complete, as the SocketError a blocking Send() throws
+    SocketError sendError(const IoResult &r) const
+    {
+      if (r.status == IoResult::Timeout) {
+        return SocketError("Client send timeout, peer is not reading!");
       }
+      errno = r.error;
+      return SocketError();
     }
 
+    // receive everything queued on the socket into out, see RecvBuffer::Drain()
+    // at most one full buffer per call, a fast sender cannot grow out without bound, the rest waits for the next read
+    ssize_t drain(string &out)
+    {
+      size_t before = out.size();
+      ssize_t r = inbuf.Drain(sockfd, out, [this] (const ssize_t n) { metrics.Received(n); }, inbuf.MaxCapacity());
+      if (out.size() > before) {
+        replied();
+      }
+      return r;
+    }
+
+    // write through the outbound queue, a short write or EAGAIN queues the rest and waits for
+    // writability instead of failing, so large responses reach the wire intact
+    ssize_t sendAll(const char *data, const size_t len) const
+    {
+      IoResult r = TrySend(data, len, sendTimeout);
+      if (r.Failed()) {
+        errno = r.error;
+        throw SocketError();
+      }
+      if (!r) {
+        throw SocketError("Client send timeout, peer is not reading!");
+      }
+      return len;
+    }
+
+    // poll for data unless timeout is 0, a wait that ran out is counted as a poll timeout
+    IoResult readable(const int timeout) const
+    {
+      if (!timeout) {
+        return IoResult(IoResult::Ok);
+      }
+      IoResult r = PollFor(sockfd, POLLIN, timeout);
+      if (r.status == IoResult::Timeout) {
+        metrics.PollTimeout();
+      }
+      return r;
+    }
+
+    
     void closeHandler() const
     {
       Close();
@@ -99,154 +187,481 @@ class Client
     // use with Connect() method
     Client() {}
     // immediately initialize the client socket with the port and ip provided
-    Client(const int port, const string ip = "127.0.0.1")  {initSocket(port, ip);}
+    // socket options are applied before connecting (buffer sizes) and to the connected socket
+    // ip "unix:/path" or "unix:@name" connects to a Unix domain socket on this host, the port is ignored then
+    Client(const int port, const string ip = "127.0.0.1", const SocketOptions &o = SocketOptions()) : opts(o) {initSocket(port, ip);}
     virtual ~Client() {}
 
-    virtual void Connect(const int port, const string ip = "127.0.0.1")
+    virtual void Connect(const int port, const string ip = "127.0.0.1", const SocketOptions &o = SocketOptions())
     {
+      opts = o;
       initSocket(port, ip);
     }
 
+    int Fd() const { return sockfd; }
+
+    // non-blocking health check: false if the peer closed, the socket has an error
+    // or unread data is waiting that would confuse the next user of a pooled connection
+    bool IsAlive() const
+    {
+      if (sockfd < 0) {
+        return false;
+      }
+      pollfd p{sockfd, POLLIN | POLLPRI, 0};
+      int r = poll(&p, 1, 0);
+      if (r < 0) {
+        return false;
+      }
+      if (r == 0) {
+        return true;
+      }
+      if (p.revents & (POLLERR | POLLHUP | POLLNVAL | POLLPRI)) {
+        return false;
+      }
+      char c;
+      ssize_t n = recv(sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+      return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+
     virtual string Send(const string msg) const
     {
 	try
 	{
-	  int n = send(sockfd, msg.c_str(), strlen(msg.c_str()), 0);
-	  if (n < 0) {
-	    throw SocketError();
-	  }
+	  sendAll(msg.data(), msg.size());
 	}
 	catch (SocketError& e)
 	{
-	  cerr << "Client Send Error: " << e.what() << endl;
+	  TCP_LOG_ERROR("Client Send Error: " << e.what());
 	  closeHandler();
 	}
 	return msg;
     }
 
-    // send data synchronously, use only after calling Listen() method
+    // binary-safe send from a caller owned buffer, returns bytes sent
+    virtual ssize_t Send(const char *data, const size_t len) const
+    {
+	try
+	{
+	  return sendAll(data, len);
+	}
+	catch (SocketError& e)
+	{
+	  TCP_LOG_ERROR("Client Send Error: " << e.what());
+	  closeHandler();
+	}
+	return -1;
+    }
+
+    ssize_t Send(ConstBuffer buf) const { return Send(buf.data, buf.size); }
+
+    // send data synchronously through the I/O loop
     virtual const string SendAsync(const string &msg) const
     {
 	try
 	{
-	  auto l = [] (const int sockfd, const string &msg)
-	  {
-	    // cout << "client send async using lambda function." << endl; 
-	    ssize_t n{send(sockfd, msg.c_str(), strlen(msg.c_str()), 0)};
-	    if (n < 0) {
-	      throw SocketError();
-	    }
-	    return msg;
-	  };
-
-	  auto sf = std::async(l, sockfd, msg); 
-	  auto d = sf.get();
-	  return d;
+	  SendFuture(msg).get();
 	}
 	catch (SocketError& e)
 	{
-	  cerr << "Server Async Send Error: " << e.what() << endl;
+	  TCP_LOG_ERROR("Server Async Send Error: " << e.what());
 	  closeHandler();
 	}
 	return msg;
     }
 
+    // everything received so far, the receive buffer grows with the burst instead of cutting it at a fixed size
     virtual const string Read()
     {
-	char buffer[1024];
+	string data;
         try
         {
-          // check socket event for available data, wait 200 milliseconds for timeout
-          rd = poll(rs, 1, 10); //200
+          AsyncIo::Blocking turn(aio, AsyncIo::Reading);
+          // check socket event for available data, wait pollTimeout milliseconds
+          rd = poll(rs, 1, pollTimeout);
           if (rd < 0) {
             throw SocketError();
           }
           else if (rd == 0) {
-            cout << "Client read timeout error! No data received!\n";
+            metrics.PollTimeout();
+            TCP_LOG_INFO("Client read timeout error! No data received!");
           }
           else {
             ssize_t n{1};
-            bzero(buffer, sizeof(buffer));
             // check for events on newsockfd:
             if (rs[0].revents & POLLIN) {
               rs[0].revents = 0;
-              n = {recv(sockfd, buffer, sizeof(buffer), 0)}; // received normal data
+              n = drain(data); // received normal data
             }
             if (rs[0].revents & POLLPRI) {
               rs[0].revents = 0;
-              n = {recv(sockfd, buffer, sizeof(buffer), MSG_OOB)}; // out-of-band data
+              char oob;
+              n = {recv(sockfd, &oob, 1, MSG_OOB)}; // out-of-band data
+              received(n);
+              if (n > 0) {
+                data += oob;
+              }
             }
-            if (n == 0){
-              cout << "Client read error, socket is closed or disconnected!\n";
+            if (n == 0 && data.empty()){
+              TCP_LOG_INFO("Client read error, socket is closed or disconnected!");
             }
           }
         }
         catch (SocketError& e)
         {
-          cerr << "Client Read Error: " << e.what() << endl;
+          TCP_LOG_ERROR("Client Read Error: " << e.what());
+          closeHandler();
+        }
+        return data;
+    }
+
+    // binary-safe read straight into a caller owned buffer, nothing is allocated or copied
+    // returns bytes received, 0 if the peer closed, -1 on read timeout (errno EAGAIN)
+    virtual ssize_t Read(char *buf, const size_t len)
+    {
+        try
+        {
+          AsyncIo::Blocking turn(aio, AsyncIo::Reading);
+          rd = poll(rs, 1, pollTimeout);
+          if (rd < 0) {
+            throw SocketError();
+          }
+          else if (rd == 0) {
+            metrics.PollTimeout();
+            errno = EAGAIN;
+            return -1;
+          }
+          // out-of-band data only when nothing else is readable, a hang-up or error takes the plain recv
+          // so it returns 0 or the real errno
+          int flags = !(rs[0].revents & POLLIN) && (rs[0].revents & POLLPRI) ? MSG_OOB : 0;
+          rs[0].revents = 0;
+          ssize_t n{recv(sockfd, buf, len, flags)};
+          received(n);
+          if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            throw SocketError();
+          }
+          return n;
+        }
+        catch (SocketError& e)
+        {
+          TCP_LOG_ERROR("Client Read Error: " << e.what());
           closeHandler();
         }
-        return buffer;
+        return -1;
+    }
+
+    ssize_t Read(MutableBuffer buf) { return Read(buf.data, buf.size); }
+
+    // framed read: wait for data like Read(), receive it into the codec and append every complete
+    // message to msgs, returns the number of messages decoded (SocketError on a malformed frame)
+    size_t ReadMessages(Codec &codec, vector<string> &msgs, const size_t chunk = 16384)
+    {
+      ssize_t n = Read(codec.Prepare(chunk), chunk);
+      if (n > 0) {
+        codec.Commit(n);
+      }
+      return codec.Decode(msgs);
     }
 
     // virtual const string ReadAsync()
+    // bufsize sizes the first recv, the buffer grows from there until the socket is drained
     virtual const string ReadAsync(int bufsize=1024) 
     {
 	// async data
 	string ad;
         try
         { 
-          auto l = [] (const int sockfd, const int &bufsize=1024)
+          auto l = [this] (const int bufsize)
           {
             string s;
-            char buffer[bufsize];
-            bzero(buffer, sizeof(buffer));
-            ssize_t n{recv(sockfd, buffer, sizeof(buffer), 0)};
+            inbuf.Reserve(bufsize > 0 ? bufsize : 1);
+            ssize_t n{drain(s)};
 
-            // cout << "client read async lamda n bytes = " << n << endl; 
-            if (n < 0) {
-              cout << "client read async lamda error: No data available" << endl;
+            TCP_LOG_DEBUG("client read async lamda n bytes = " << s.size());
+            if (n < 0 && s.empty()) {
+              TCP_LOG_INFO("client read async lamda error: No data available");
             }
-            if (n == 0){
-              cout << "client read async lamda error, socket at the other end is closed or disconnected!\n";
+            if (n == 0 && s.empty()){
+              TCP_LOG_INFO("client read async lamda error, socket at the other end is closed or disconnected!");
             }
-            s = &buffer[0];
-            // cout << "return buffer" << endl;
             return s;
           };
 
-          // check socket event for available data, wait 10 milliseconds for timeout
-          rv = poll(rs, 1, 10); // adjust not higher than 10 ms for optimum wait time
+          AsyncIo::Blocking turn(aio, AsyncIo::Reading);
+          // check socket event for available data, wait pollTimeout milliseconds
+          rv = poll(rs, 1, pollTimeout);
           if (rv < 0) {
             throw SocketError();
           }
           else if (rv == 0) {
-            cout << "client read async timeout error! No data received!\n";
+            metrics.PollTimeout();
+            TCP_LOG_INFO("client read async timeout error! No data received!");
           }
           else {
             ssize_t n{1};
             if (rs[0].revents & POLLIN) {
-            rs[0].revents = 0;
-	    // return future data(fd) using inline lamda function
-            auto rf = async(l, sockfd, bufsize); 
-            ad = rf.get();
+              rs[0].revents = 0;
+              ad = l(bufsize);
             }
             if (n == 0){
-              cout << "client read async error, socket is closed or disconnected!\n";
+              TCP_LOG_INFO("client read async error, socket is closed or disconnected!");
             }
           }
         }
         catch (SocketError& e)
         {
-          cerr << "Client Read Async Error: " << e.what() << endl;
+          TCP_LOG_ERROR("Client Read Async Error: " << e.what());
           closeHandler();
         }
         return ad;
     }
 
+    // asynchronous send on the shared I/O loop, no thread waits while the peer is slow
+    // sends on this client are written in call order, after a blocking Send() that is in progress
+    // the future resolves with the bytes sent or rethrows the SocketError
+    // above the send watermark the caller waits for earlier sends to drain, SocketError after the send timeout
+    future<ssize_t> SendFuture(string msg) const
+    {
+      const size_t len = msg.size();
+      if (!pressure.Acquire(len, sendTimeout)) {
+        throw SocketError("Client send queue is full, peer is not reading!");
+      }
+      auto p = make_shared<promise<ssize_t>>();
+      future<ssize_t> f = p->get_future();
+      aio.Send(sockfd, make_shared<const string>(move(msg)), sendTimeout, [this, p, len] (const IoResult r)
+      {
+        pressure.Release(len);
+        if (r) {
+          p->set_value(len);
+        }
+        else {
+          p->set_exception(make_exception_ptr(sendError(r)));
+        }
+      });
+      return f;
+    }
+
+    // same with a completion callback, run on an executor thread with the bytes sent or -1 on error
+    // (on the calling thread when the send queue stayed full for the send timeout)
+    void SendAsync(string msg, function<void(ssize_t)> done) const
+    {
+      const size_t len = msg.size();
+      if (!pressure.Acquire(len, sendTimeout)) {
+        if (done) { done(-1); }
+        return;
+      }
+      aio.Send(sockfd, make_shared<const string>(move(msg)), sendTimeout, [this, len, done] (const IoResult r)
+      {
+        pressure.Release(len);
+        if (done) {
+          const ssize_t n = r ? static_cast<ssize_t>(len) : -1;
+          Executor::Default().Post([done, n] { done(n); });
+        }
+      });
+    }
+
+    // limit the bytes SendFuture()/SendAsync() may have waiting: at high the caller blocks until
+    // the queue drained to low, 0 turns it off (the default)
+    void SetSendWatermarks(const size_t high, const size_t low) { pressure.Set(high, low); }
+
+    // send SendFuture()/SendAsync() payloads of at least threshold bytes with MSG_ZEROCOPY, from the
+    // string itself; worth it for large payloads on a real NIC, over loopback the kernel copies anyway
+    // and the connection falls back to regular sends. 0 turns it off for the next connection
+    void EnableZeroCopy(const size_t threshold = 32768)
+    {
+      zeroCopyMin = threshold;
+      // the asynchronous sends use zc on the I/O loop
+      AsyncIo::Blocking turn(aio, AsyncIo::Sending);
+      if (threshold && sockfd >= 0) {
+        zc.Enable(sockfd, threshold);
+      }
+    }
+    // bytes handed to SendFuture()/SendAsync() and not written yet
+    size_t Queued() const { return pressure.Queued(); }
+    // bytes not on the wire yet, from SendFuture()/SendAsync() or left over by a timed out Send(), never blocks
+    // the outbound queue is only looked at once no future is pending, nothing else touches it then
+    size_t Unsent() const
+    {
+      size_t q = Queued();
+      return q ? q : outbuf.Size();
+    }
+
+    // asynchronous read on the shared I/O loop, waits up to timeout milliseconds (-1 forever) for data
+    // the future resolves with the data received, empty on timeout or if the peer closed
+    future<string> ReadFuture(const size_t bufsize = 1024, const int timeout = 1000)
+    {
+      auto p = make_shared<promise<string>>();
+      future<string> f = p->get_future();
+      aio.Read(sockfd, bufsize, timeout, [this, p] (const IoResult r, string s)
+      {
+        if (r.status == IoResult::Error) {
+          errno = r.error;
+          p->set_exception(make_exception_ptr(SocketError()));
+          return;
+        }
+        if (r.status == IoResult::Timeout) {
+          metrics.PollTimeout();
+        }
+        p->set_value(move(s));
+      });
+      return f;
+    }
+
+    // same with a completion callback, run on an executor thread
+    void ReadAsync(function<void(string)> done, const size_t bufsize = 1024, const int timeout = 1000)
+    {
+      aio.Read(sockfd, bufsize, timeout, [this, done] (const IoResult r, string s)
+      {
+        if (r.status == IoResult::Timeout) {
+          metrics.PollTimeout();
+        }
+        if (done) {
+          Executor::Default().Post(bind(done, move(s)));
+        }
+      });
+    }
+
+    // wait up to timeout milliseconds (-1 blocks) for queued bytes to be written, returns bytes still queued
+    size_t Flush(const int timeout = -1) const
+    {
+      AsyncIo::Blocking turn(aio, AsyncIo::Sending);
+      IoResult r = TryFlush(timeout);
+      if (r.Failed()) {
+        errno = r.error;
+        throw SocketError();
+      }
+      return outbuf.Size();
+    }
+
+    /*
+     * Non-throwing API: errors, timeouts and EAGAIN come back as an IoResult status instead of a
+     * SocketError and the connection is left open for the caller to decide.
+     * timeout is in milliseconds, -1 waits forever and 0 never waits.
+     */
+
+    // like Connect(), Ok once connected, Timeout if no address answered in time, Closed when refused
+    IoResult TryConnect(const int port, const string ip = "127.0.0.1", const SocketOptions &o = SocketOptions())
+    {
+      try
+      {
+        Connect(port, ip, o);
+        return IoResult(IoResult::Ok);
+      }
+      catch (SocketError&)
+      {
+        int err = errno ? errno : EINVAL;
+        return err == ECONNREFUSED ? IoResult(IoResult::Closed, 0, err) : IoResult::FromErrno(err);
+      }
+    }
+
+    // like Flush(), Ok once nothing is queued, WouldBlock or Timeout while bytes are still queued
+    IoResult TryFlush(const int timeout = -1) const
+    {
+      AsyncIo::Blocking turn(aio, AsyncIo::Sending);
+      auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout);
+      size_t written = 0;
+      while (!outbuf.Empty()) {
+        int wait = -1;
+        if (timeout >= 0) {
+          auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+          wait = left > 0 ? static_cast<int>(left) : 0;
+        }
+        IoResult p = PollFor(sockfd, POLLOUT, wait);
+        if (p.status == IoResult::Timeout) {
+          return IoResult(timeout ? IoResult::Timeout : IoResult::WouldBlock, written);
+        }
+        if (p.Failed()) {
+          return p;
+        }
+        ssize_t n = sent(outbuf.WriteTo(sockfd));
+        if (n < 0) {
+          return IoResult::FromErrno(errno);
+        }
+        if (!n && zc.Used()) {
+          // woken by zero-copy completions, not by room in the send buffer
+          zc.Reap(sockfd);
+        }
+        written += n;
+      }
+      return IoResult(IoResult::Ok, written);
+    }
+
+    // send or queue all of data, then wait up to timeout for the queue to drain
+    // bytes is len unless the send failed, WouldBlock or Timeout mean part of it is still queued
+    IoResult TrySend(const char *data, const size_t len, const int timeout = 0) const
+    {
+      AsyncIo::Blocking turn(aio, AsyncIo::Sending);
+      if (sent(outbuf.WriteTo(sockfd, data, len)) < 0) {
+        return IoResult::FromErrno(errno);
+      }
+      IoResult r = outbuf.Empty() ? IoResult(IoResult::Ok) : TryFlush(timeout);
+      if (!r.Failed()) {
+        r.bytes = len;
+      }
+      return r;
+    }
+
+    IoResult TrySend(ConstBuffer buf, const int timeout = 0) const { return TrySend(buf.data, buf.size, timeout); }
+
+    // append everything available to out, Ok with the bytes read, WouldBlock or Timeout without data,
+    // Closed once the peer has closed
+    IoResult TryRead(string &out, const int timeout = 0)
+    {
+      AsyncIo::Blocking turn(aio, AsyncIo::Reading);
+      IoResult r = readable(timeout);
+      if (!r) {
+        return r;
+      }
+      size_t before = out.size();
+      ssize_t n = drain(out);
+      if (out.size() > before) {
+        return IoResult(IoResult::Ok, out.size() - before);
+      }
+      return n == 0 ? IoResult(IoResult::Closed) : IoResult::FromErrno(errno);
+    }
+
+    // one recv into a caller owned buffer
+    IoResult TryRead(char *buf, const size_t len, const int timeout = 0)
+    {
+      AsyncIo::Blocking turn(aio, AsyncIo::Reading);
+      IoResult r = readable(timeout);
+      if (!r) {
+        return r;
+      }
+      ssize_t n;
+      do {
+        n = recv(sockfd, buf, len, 0);
+      } while (n < 0 && errno == EINTR);
+      received(n);
+      return IoResult::FromCall(n);
+    }
+
+    IoResult TryRead(MutableBuffer buf, const int timeout = 0) { return TryRead(buf.data, buf.size, timeout); }
+
+    // how long Connect() waits for any address of the peer to answer, -1 leaves it to the kernel
+    void SetConnectTimeout(const int ms) { connectTimeout = ms; }
+
+    // how long Send/SendAsync wait for a slow peer to take queued bytes, -1 waits forever
+    void SetSendTimeout(const int ms) { sendTimeout = ms; }
+    // how long Read() and ReadAsync() wait for data before reporting a read timeout, 10 ms by default, -1 blocks
+    void SetPollTimeout(const int ms) { pollTimeout = ms; }
+
+    // Cork(true) holds partial segments while a request is built from several Sends, Cork(false) pushes them out
+    void Cork(const bool on) const { SocketOptions::Cork(sockfd, on); }
+
+    // counters and histograms of this client, see Metrics::Snap() and Export()
+    Metrics& Stats() const { return metrics; }
+
     virtual void Close() const
     {
-        close(sockfd);
+        aio.Detach();
+        if (sockfd >= 0) {
+          metrics.Disconnected();
+          if (zc.Retire(sockfd)) {
+            IoLoop::Default().SweepRetired();
+          }
+          close(sockfd);
+          sockfd = -1;
+        }
     }
 };
 
@@ -0,0 +1,200 @@
+/*
+ * Source File: clientpool.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2017 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "client.h"
+
+namespace Tcp {
+
+using namespace std;
+
+/*
+ * Warm Client connections keyed by ip:port, so forwarding a message costs one send instead of
+ * a getaddrinfo lookup, a handshake and a teardown. Idle sockets use TCP keep-alive and are
+ * health checked before they are handed out again. At most maxActive connections per endpoint
+ * are checked out at once, Acquire() waits for a lease to come back beyond that.
+ * The pool must outlive its leases.
+ */
+class ClientPool
+{
+  struct Idle
+  {
+    unique_ptr<Client> client;
+    chrono::steady_clock::time_point since;
+  };
+
+  mutable mutex m;
+  condition_variable returned;
+  unordered_map<string, vector<Idle>> idle;
+  unordered_map<string, size_t> active; // leases out per endpoint
+  size_t maxIdle, maxActive;
+  chrono::milliseconds maxIdleTime, acquireTimeout;
+  SocketOptions opts;
+
+  static string key(const int port, const string &ip) { return ip + ":" + to_string(port); }
+
+  // a lease of k ended, its slot goes to the next Acquire() waiting for it
+  void done(const string &k)
+  {
+    lock_guard<mutex> lk(m);
+    auto it = active.find(k);
+    if (it != active.end() && it->second && !--it->second) {
+      active.erase(it);
+    }
+    returned.notify_all();
+  }
+
+  // a connection with bytes still queued is discarded, not flushed: that would wait for a pending
+  // send in the lease's destructor, and the bytes would reach the next user's peer late
+  void release(const string &k, unique_ptr<Client> c)
+  {
+    {
+      lock_guard<mutex> lk(m);
+      auto &v = idle[k];
+      if (c->Unsent() == 0 && v.size() < maxIdle) {
+        v.push_back(Idle{move(c), chrono::steady_clock::now()});
+      }
+    }
+    if (c) {
+      c->Close();
+    }
+    done(k);
+  }
+
+  void discard(const string &k, unique_ptr<Client> c)
+  {
+    c->Close();
+    done(k);
+  }
+
+  public:
+    // a checked out connection, goes back to the pool when destroyed unless Discard() was called
+    class Lease
+    {
+      ClientPool *pool;
+      string k;
+      unique_ptr<Client> c;
+
+      public:
+        Lease(ClientPool *pool, string k, unique_ptr<Client> c) : pool{pool}, k{move(k)}, c{move(c)} {}
+        Lease(Lease&&) = default;
+        // the connection held so far goes back to its pool first, ~Client would not close it
+        Lease& operator=(Lease &&l)
+        {
+          if (this != &l) {
+            if (c) {
+              pool->release(k, move(c));
+            }
+            pool = l.pool;
+            k = move(l.k);
+            c = move(l.c);
+          }
+          return *this;
+        }
+        ~Lease()
+        {
+          if (c) {
+            pool->release(k, move(c));
+          }
+        }
+
+        Client* operator->() const { return c.get(); }
+        Client& operator*() const { return *c; }
+
+        // close the connection instead of returning it, use after a send or read error
+        void Discard()
+        {
+          if (c) {
+            pool->discard(k, move(c));
+          }
+        }
+    };
+
+    // maxIdle connections are kept per endpoint, idle ones older than maxIdleTime are closed
+    // maxActive leases per endpoint at once (0 for no limit), Acquire() waits up to acquireTimeout for one
+    // (-1 forever), new connections use opts with keep-alive forced on
+    explicit ClientPool(const size_t maxIdle = 8, const chrono::milliseconds maxIdleTime = chrono::seconds(60), const SocketOptions &o = SocketOptions(),
+                        const size_t maxActive = 64, const chrono::milliseconds acquireTimeout = chrono::seconds(5))
+      : maxIdle{maxIdle}, maxActive{maxActive}, maxIdleTime{maxIdleTime}, acquireTimeout{acquireTimeout}, opts(o)
+    {
+      opts.keepAlive = true;
+    }
+    ClientPool(const ClientPool&) = delete;
+    ClientPool& operator=(const ClientPool&) = delete;
+
+    virtual ~ClientPool() { Clear(); }
+
+    // most recently used healthy connection to ip:port, or a new one, SocketError if it cannot connect
+    // or if maxActive leases of ip:port stayed out for the acquire timeout (errno EAGAIN)
+    Lease Acquire(const int port, const string ip = "127.0.0.1")
+    {
+      string k = key(port, ip);
+      {
+        unique_lock<mutex> lk(m);
+        auto room = [&] { return !maxActive || active[k] < maxActive; };
+        if (acquireTimeout.count() < 0) {
+          returned.wait(lk, room);
+        }
+        else if (!returned.wait_for(lk, acquireTimeout, room)) {
+          errno = EAGAIN;
+          throw SocketError("Client pool exhausted");
+        }
+        active[k]++;
+        auto now = chrono::steady_clock::now();
+        auto it = idle.find(k);
+        while (it != idle.end() && !it->second.empty()) {
+          Idle e = move(it->second.back());
+          it->second.pop_back();
+          if (now - e.since < maxIdleTime && e.client->IsAlive()) {
+            return Lease(this, k, move(e.client));
+          }
+          e.client->Close();
+        }
+      }
+      unique_ptr<Client> c(new Client);
+      try
+      {
+        c->Connect(port, ip, opts);
+      }
+      catch (SocketError&)
+      {
+        done(k);
+        throw;
+      }
+      return Lease(this, k, move(c));
+    }
+
+    size_t IdleCount() const
+    {
+      lock_guard<mutex> lk(m);
+      size_t n = 0;
+      for (auto &e : idle) {
+        n += e.second.size();
+      }
+      return n;
+    }
+
+    // close every idle connection
+    void Clear()
+    {
+      lock_guard<mutex> lk(m);
+      for (auto &e : idle) {
+        for (auto &i : e.second) {
+          i.client->Close();
+        }
+      }
+      idle.clear();
+    }
+};
+
+}
@@ -0,0 +1,204 @@
+/*
+ * Source File: codec.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2017 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "socketerror.h"
+
+namespace Tcp {
+
+using namespace std;
+
+/*
+ * Optional message framing on top of the byte stream.
+ * Received bytes are appended to a streaming buffer (Prepare/Commit lets recv write into it directly)
+ * and Decode hands out every complete message in one batch, so many small messages cost one recv.
+ */
+class Codec
+{
+  string in;
+  size_t rpos = 0, wpos = 0;
+
+  protected:
+    size_t maxFrame;
+
+    // find the next frame in p[0..avail) and its header/body/trailer sizes, false if it is incomplete
+    virtual bool frame(const char *p, const size_t avail, size_t &header, size_t &body, size_t &trailer) const = 0;
+
+  public:
+    explicit Codec(const size_t maxFrame = 16 << 20) : maxFrame{maxFrame} {}
+    virtual ~Codec() {}
+
+    // frame a message and append it to out, encode several messages into one string to send them in one call
+    virtual void Encode(const char *data, const size_t len, string &out) const = 0;
+
+    string Encode(const string &msg) const
+    {
+      string out;
+      Encode(msg.data(), msg.size(), out);
+      return out;
+    }
+
+    // writable space of at least n bytes at the end of the receive buffer, follow with Commit()
+    char* Prepare(const size_t n)
+    {
+      if (rpos == wpos) {
+        rpos = wpos = 0;
+      }
+      else if (rpos > in.size() / 2) {
+        // compact once the consumed prefix dominates the buffer
+        memmove(&in[0], &in[rpos], wpos - rpos);
+        wpos -= rpos;
+        rpos = 0;
+      }
+      if (in.size() - wpos < n) {
+        in.resize(wpos + n);
+      }
+      return &in[wpos];
+    }
+
+    void Commit(const size_t n) { wpos += n; }
+
+    void Feed(const char *data, const size_t len)
+    {
+      memcpy(Prepare(len), data, len);
+      Commit(len);
+    }
+
+    size_t Buffered() const { return wpos - rpos; }
+
+    /*
+     * Call f(const char *data, size_t len) for every complete message, the pointers are only valid
+     * until the next Prepare/Feed. Returns the number of messages decoded.
+     * Throws SocketError on an oversized or malformed frame.
+     */
+    template <typename F>
+    size_t Decode(F f)
+    {
+      size_t count = 0, header, body, trailer;
+      while (rpos < wpos && frame(&in[rpos], wpos - rpos, header, body, trailer)) {
+        f(static_cast<const char*>(&in[rpos + header]), body);
+        rpos += header + body + trailer;
+        count++;
+      }
+      return count;
+    }
+
+    size_t Decode(vector<string> &msgs)
+    {
+      return Decode([&msgs] (const char *p, size_t n) { msgs.emplace_back(p, n); });
+    }
+};
+
+// each message is preceded by its length as a varint (LEB128) or a fixed 32-bit big-endian integer
+class LengthCodec : public Codec
+{
+  public:
+    enum Prefix { Varint, Fixed32 };
+
+  private:
+    Prefix prefix;
+
+  protected:
+    bool frame(const char *p, const size_t avail, size_t &header, size_t &body, size_t &trailer) const override
+    {
+      const unsigned char *u = reinterpret_cast<const unsigned char*>(p);
+      uint64_t len = 0;
+      trailer = 0;
+      if (prefix == Fixed32) {
+        if (avail < 4) {
+          return false;
+        }
+        len = (uint64_t(u[0]) << 24) | (uint64_t(u[1]) << 16) | (uint64_t(u[2]) << 8) | u[3];
+        header = 4;
+      }
+      else {
+        size_t i = 0;
+        for (;; i++) {
+          if (i == avail) {
+            return false;
+          }
+          if (i == 5) {
+            throw SocketError("Malformed varint length prefix");
+          }
+          len |= uint64_t(u[i] & 0x7f) << (7 * i);
+          if (!(u[i] & 0x80)) {
+            break;
+          }
+        }
+        header = i + 1;
+      }
+      if (len > maxFrame) {
+        throw SocketError("Frame exceeds the codec size limit");
+      }
+      body = len;
+      return avail - header >= body;
+    }
+
+  public:
+    explicit LengthCodec(const Prefix prefix = Varint, const size_t maxFrame = 16 << 20) : Codec(maxFrame), prefix{prefix} {}
+
+    void Encode(const char *data, const size_t len, string &out) const override
+    {
+      char h[5];
+      size_t n = 0;
+      if (prefix == Fixed32) {
+        uint32_t l = static_cast<uint32_t>(len);
+        h[0] = char(l >> 24); h[1] = char(l >> 16); h[2] = char(l >> 8); h[3] = char(l);
+        n = 4;
+      }
+      else {
+        uint64_t l = len;
+        do {
+          h[n++] = char((l & 0x7f) | (l > 0x7f ? 0x80 : 0));
+          l >>= 7;
+        } while (l);
+      }
+      out.append(h, n);
+      out.append(data, len);
+    }
+};
+
+// messages end with a delimiter, e.g. "\n" or "\r\n", which is stripped on decode
+class DelimiterCodec : public Codec
+{
+  string delim;
+
+  protected:
+    bool frame(const char *p, const size_t avail, size_t &header, size_t &body, size_t &trailer) const override
+    {
+      const char *end = static_cast<const char*>(memmem(p, avail, delim.data(), delim.size()));
+      if (!end) {
+        if (avail > maxFrame) {
+          throw SocketError("Frame exceeds the codec size limit");
+        }
+        return false;
+      }
+      header = 0;
+      body = end - p;
+      trailer = delim.size();
+      return true;
+    }
+
+  public:
+    explicit DelimiterCodec(const string delim = "\n", const size_t maxFrame = 16 << 20) : Codec(maxFrame), delim{delim}
+    {
+      if (this->delim.empty()) {
+        throw SocketError("Empty frame delimiter");
+      }
+    }
+
+    void Encode(const char *data, const size_t len, string &out) const override
+    {
+      out.append(data, len);
+      out.append(delim);
+    }
+};
+
+}
@@ -0,0 +1,457 @@
+/*
+ * Source File: connection.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2017 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "eventloop.h"
+#include "buffer.h"
+#include "ringbuffer.h"
+#include "codec.h"
+#include "metrics.h"
+#include "recvbuffer.h"
+#include "socketoptions.h"
+#include "zerocopy.h"
+#include "logger.h"
+
+namespace Tcp {
+
+using namespace std;
+
+class Connection;
+
+using ConnectionHandler = function<void(Connection&)>;
+
+// per-connection callbacks, all of them run on the event loop thread
+struct ConnectionHandlers
+{
+  ConnectionHandler onConnect;
+  ConnectionHandler onRead;
+  ConnectionHandler onWrite; // socket writable and the outbound queue fully flushed
+  ConnectionHandler onClose;
+  ConnectionHandler onHighWater; // outbound queue grew to the high watermark, stop producing for this peer
+  ConnectionHandler onLowWater;  // queue drained back to the low watermark after onHighWater
+};
+
+// edge-triggered registration of a connection, EPOLLIN and EPOLLRDHUP are left out while reading is paused
+const uint32_t ConnectionEvents = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+
+/*
+ * One accepted socket owned by an event loop.
+ * The socket is registered edge-triggered, so onRead must drain it with Read() until it returns empty.
+ * One wake-up reads at most ReadBudget bytes, the reactor then runs onRead again for the rest after
+ * the other ready connections. When the peer closed, the connection is closed once onRead returns.
+ */
+class Connection : public enable_shared_from_this<Connection>
+{
+  friend class Reactor;
+
+  public:
+    // bytes taken from the socket per wake-up
+    static const size_t ReadBudget = 65536;
+
+  protected:
+    int fd;
+    EventLoop &loop;
+    sockaddr_storage peer;
+    bool closed = false;
+    // budget left in this wake-up, ended once the peer closed or the socket failed
+    size_t budget = ReadBudget;
+    bool ended = false;
+    function<void(int)> release;
+    RingBuffer out;
+    RecvBuffer inbuf;
+    Metrics *metrics;
+    uint64_t bytesIn = 0, bytesOut = 0;
+    // deadlines on the loop's timer wheel, 0 ms is off
+    TimerWheel::Timer idleTimer, readTimer, writeTimer;
+    uint64_t idleTimeout = 0, readTimeout = 0, writeTimeout = 0;
+    // outbound watermarks in bytes, 0 is off; water(true) runs when Pending() reaches high,
+    // water(false) once it is back at low
+    size_t highWater = 0, lowWater = 0;
+    bool aboveHigh = false, paused = false;
+    function<void(bool)> water;
+    // MSG_ZEROCOPY state, zcBuf is the payload still being handed to the kernel, it goes out before `out`
+    ZeroCopy zc;
+    shared_ptr<const string> zcBuf;
+    size_t zcOff = 0;
+
+    // count one recv/send here and in the server totals, errno must still be the one of the call
+    void countRecv(const ssize_t n)
+    {
+      if (n > 0) {
+        bytesIn += n;
+        if (idleTimeout) {
+          loop.Timers().Schedule(idleTimer, idleTimeout);
+        }
+        if (readTimeout) {
+          loop.Timers().Schedule(readTimer, readTimeout);
+        }
+      }
+      if (metrics) {
+        metrics->Received(n);
+      }
+    }
+
+    ssize_t countSend(const ssize_t n)
+    {
+      if (n > 0) {
+        bytesOut += n;
+        if (idleTimeout) {
+          loop.Timers().Schedule(idleTimer, idleTimeout);
+        }
+      }
+      watchWrite(n > 0);
+      checkWater();
+      if (metrics) {
+        metrics->Sent(n, Pending());
+      }
+      return n;
+    }
+
+    void checkWater()
+    {
+      if (!highWater || closed) {
+        return;
+      }
+      size_t p = Pending();
+      if (!aboveHigh && p >= highWater) {
+        aboveHigh = true;
+        if (water) {
+          water(true);
+        }
+      }
+      else if (aboveHigh && p <= lowWater) {
+        aboveHigh = false;
+        if (water) {
+          water(false);
+        }
+      }
+    }
+
+    // the write deadline runs while bytes are queued and restarts whenever some of them went out
+    void watchWrite(const bool progress)
+    {
+      if (!writeTimeout || closed) {
+        return;
+      }
+      if (!Pending()) {
+        writeTimer.Cancel();
+      }
+      else if (progress || !writeTimer.Armed()) {
+        loop.Timers().Schedule(writeTimer, writeTimeout);
+      }
+    }
+
+    // continue the zero-copy payload, false on a hard error
+    bool sendZeroCopy()
+    {
+      while (zcBuf) {
+        ssize_t n = zc.Send(fd, zcBuf, zcBuf->data() + zcOff, zcBuf->size() - zcOff);
+        if (n > 0) {
+          zcOff += n;
+          if (zcOff == zcBuf->size()) {
+            zcBuf.reset();
+          }
+        }
+        if (countSend(n) <= 0) {
+          return n == 0;
+        }
+      }
+      return true;
+    }
+
+    void timedOut(const char *what)
+    {
+      TCP_LOG_DEBUG("Connection " << Peer() << " " << what << " timeout");
+      if (metrics) {
+        metrics->TimedOut();
+      }
+      Close();
+    }
+
+    void cancelTimers()
+    {
+      idleTimer.Cancel();
+      readTimer.Cancel();
+      writeTimer.Cancel();
+    }
+
+  public:
+    Connection(const int fd, EventLoop &loop, const sockaddr_storage &peer, function<void(int)> release, Metrics *metrics = nullptr)
+      : fd{fd}, loop(loop), peer(peer), release{move(release)}, metrics{metrics},
+        idleTimer([this] { timedOut("idle"); }), readTimer([this] { timedOut("read"); }), writeTimer([this] { timedOut("write"); }) {}
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+    virtual ~Connection() {}
+
+    int Fd() const { return fd; }
+    EventLoop& Loop() const { return loop; }
+    bool IsClosed() const { return closed; }
+    uint64_t BytesIn() const { return bytesIn; }
+    uint64_t BytesOut() const { return bytesOut; }
+
+    // close the connection after ms without traffic in either direction, 0 turns it off
+    // call from the loop thread, e.g. in onConnect
+    void SetIdleTimeout(const uint64_t ms)
+    {
+      idleTimeout = ms;
+      if (ms && !closed) {
+        loop.Timers().Schedule(idleTimer, ms);
+      }
+      else {
+        idleTimer.Cancel();
+      }
+    }
+
+    // close the connection when no data arrives for ms, counted from now and from every read
+    void SetReadTimeout(const uint64_t ms)
+    {
+      readTimeout = ms;
+      if (ms && !closed) {
+        loop.Timers().Schedule(readTimer, ms);
+      }
+      else {
+        readTimer.Cancel();
+      }
+    }
+
+    // close the connection when queued bytes make no progress for ms
+    void SetWriteTimeout(const uint64_t ms)
+    {
+      writeTimeout = ms;
+      writeTimer.Cancel();
+      watchWrite(false);
+    }
+
+    // outbound queue limits in bytes, crossing high runs onHighWater, draining to low runs onLowWater
+    // without those handlers reading from this connection is paused at high and resumed at low,
+    // so a peer that does not read its responses cannot make the server buffer without bound
+    // a low watermark not below high is taken as half of high
+    void SetWatermarks(const size_t high, const size_t low)
+    {
+      highWater = high;
+      lowWater = low < high ? low : high / 2;
+      checkWater();
+    }
+
+    // called by the reactor with the crossing, true for high
+    void OnWatermark(function<void(bool)> f) { water = move(f); }
+
+    // above the high watermark and not drained to the low one yet
+    bool AboveHighWater() const { return aboveHigh; }
+
+    // stop taking data from the socket, the kernel buffer fills and TCP flow control slows the peer down
+    // queued output keeps flushing, call from the loop thread
+    virtual void PauseReading()
+    {
+      if (paused || closed) {
+        return;
+      }
+      paused = true;
+      loop.Modify(fd, ConnectionEvents & ~(EPOLLIN | EPOLLRDHUP));
+    }
+
+    // re-arming the registration reports data that arrived meanwhile as a new read event
+    virtual void ResumeReading()
+    {
+      if (!paused || closed) {
+        return;
+      }
+      paused = false;
+      loop.Modify(fd, ConnectionEvents);
+    }
+
+    bool ReadingPaused() const { return paused; }
+
+    // Cork(true) holds partial segments while a response is built from several Sends, Cork(false) pushes them out
+    void Cork(const bool on) { SocketOptions::Cork(fd, on); }
+
+    // remote endpoint as ip:port
+    string Peer() const
+    {
+      char s[INET6_ADDRSTRLEN]{};
+      int port;
+      if (peer.ss_family == AF_INET6) {
+        auto a = reinterpret_cast<const sockaddr_in6*>(&peer);
+        inet_ntop(AF_INET6, &a->sin6_addr, s, sizeof s);
+        port = ntohs(a->sin6_port);
+      }
+      else {
+        auto a = reinterpret_cast<const sockaddr_in*>(&peer);
+        inet_ntop(AF_INET, &a->sin_addr, s, sizeof s);
+        port = ntohs(a->sin_port);
+      }
+      return string(s) + ":" + to_string(port);
+    }
+
+    // read what is available on the socket up to the budget of this wake-up
+    // returns empty when it would block or the peer closed
+    virtual string Read()
+    {
+      string data;
+      if (closed || ended || !budget) {
+        return data;
+      }
+      ssize_t r = inbuf.Drain(fd, data, [this] (const ssize_t n) { countRecv(n); }, budget);
+      budget -= data.size();
+      if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        ended = true;
+      }
+      return data;
+    }
+
+    // binary-safe read into a caller owned buffer, call until it returns -1 with errno EAGAIN
+    // returns bytes received, 0 if the peer closed (the connection is closed once onRead returns)
+    virtual ssize_t Read(char *buf, const size_t len)
+    {
+      if (closed || ended) {
+        return 0;
+      }
+      if (!budget) {
+        errno = EAGAIN;
+        return -1;
+      }
+      ssize_t n;
+      do {
+        n = recv(fd, buf, len < budget ? len : budget, 0);
+        countRecv(n);
+      } while (n < 0 && errno == EINTR);
+      if (n > 0) {
+        budget -= n;
+      }
+      else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        ended = true;
+      }
+      return n;
+    }
+
+    ssize_t Read(MutableBuffer buf) { return Read(buf.data, buf.size); }
+
+    // drain the socket into the codec and append every complete message to msgs
+    // a malformed or oversized frame closes the connection, returns the number of messages decoded
+    size_t ReadMessages(Codec &codec, vector<string> &msgs, const size_t chunk = 16384)
+    {
+      ssize_t n;
+      while ((n = Read(codec.Prepare(chunk), chunk)) > 0) {
+        codec.Commit(n);
+      }
+      try
+      {
+        return codec.Decode(msgs);
+      }
+      catch (SocketError&)
+      {
+        Close();
+      }
+      return 0;
+    }
+
+    // binary-safe send from a caller owned buffer, whatever the socket can't take right now is queued
+    // and flushed on writability, returns len or -1 if the connection is closed
+    virtual ssize_t Send(const char *data, const size_t len)
+    {
+      if (closed) {
+        return -1;
+      }
+      if (zcBuf) {
+        // behind a zero-copy payload that is still going out
+        out.Append(data, len);
+        watchWrite(false);
+        checkWater();
+        return len;
+      }
+      if (countSend(out.WriteTo(fd, data, len)) < 0) {
+        Close();
+        return -1;
+      }
+      return len;
+    }
+
+    ssize_t Send(ConstBuffer buf) { return Send(buf.data, buf.size); }
+    ssize_t Send(const string &msg) { return Send(msg.data(), msg.size()); }
+
+    // takes msg over, with EnableZeroCopy() a payload above the threshold is sent from msg itself
+    // and kept alive until the kernel reports it no longer needs the pages
+    ssize_t Send(string &&msg)
+    {
+      if (closed || !zc.Wants(msg.size()) || zcBuf || !out.Empty()) {
+        return Send(msg.data(), msg.size());
+      }
+      const ssize_t len = msg.size();
+      zcBuf = make_shared<const string>(move(msg));
+      zcOff = 0;
+      if (!sendZeroCopy()) {
+        Close();
+        return -1;
+      }
+      return len;
+    }
+
+    // SO_ZEROCOPY for Send(string&&) payloads of at least threshold bytes, false when the kernel
+    // or the backend does not support it
+    virtual bool EnableZeroCopy(const size_t threshold = 32768) { return zc.Enable(fd, threshold); }
+
+    // zero-copy completions arrive on the error queue and raise EPOLLERR, release their buffers
+    // true when that was all, false when the socket has a real error
+    bool ReapErrors()
+    {
+      if (!zc.Used()) {
+        return false;
+      }
+      zc.Reap(fd);
+      int err = 0;
+      socklen_t len = sizeof err;
+      return getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && !err;
+    }
+
+    // MSG_ZEROCOPY sends not yet released by the kernel, and sends the kernel copied anyway
+    size_t ZeroCopyInFlight() const { return zc.InFlight(); }
+    uint64_t ZeroCopyCopied() const { return zc.Copied(); }
+
+    // write queued bytes, called by the event loop when the socket becomes writable
+    virtual void Flush()
+    {
+      if (closed) {
+        return;
+      }
+      if (zcBuf && !sendZeroCopy()) {
+        Close();
+        return;
+      }
+      if (!zcBuf && !out.Empty() && countSend(out.WriteTo(fd)) < 0) {
+        Close();
+      }
+    }
+
+    // bytes queued but not yet accepted by the kernel
+    virtual size_t Pending() const { return out.Size() + (zcBuf ? zcBuf->size() - zcOff : 0); }
+
+    // safe to call from inside any callback, the socket is released after the current batch of events
+    // and queued bytes that were not flushed yet are dropped
+    virtual void Close()
+    {
+      if (closed) {
+        return;
+      }
+      closed = true;
+      cancelTimers();
+      loop.Remove(fd);
+      // the reactor's table owns the connection until release, a bare pointer keeps the task
+      // inside std::function's small buffer
+      loop.Defer([this] () { release(fd); });
+    }
+};
+
+}
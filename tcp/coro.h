@@ -0,0 +1,520 @@
+/*
+ * Source File: coro.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2017 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<coroutine>)
+#define TCP_HAVE_COROUTINES 1
+#endif
+#endif
+
+#ifdef TCP_HAVE_COROUTINES
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <coroutine>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+#include "buffer.h"
+#include "eventloop.h"
+#include "executor.h"
+#include "logger.h"
+#include "resolver.h"
+#include "socketerror.h"
+#include "timerwheel.h"
+
+namespace Tcp {
+
+using namespace std;
+
+/*
+ * Coroutine API (C++20, build with -std=c++20). Every session is a coroutine frame on one EventLoop
+ * instead of a thread, the code reads like the blocking API:
+ *
+ *   Task<> session(AsyncSocket s) { for (;;) { string d = co_await s.Read(); if (d.empty()) break; co_await s.Send(d); } }
+ *   Task<> server(AsyncListener &l) { for (;;) Spawn(session(co_await l.Accept())); }
+ *
+ * Tasks start when awaited or passed to Spawn(), errors are thrown as SocketError from co_await.
+ */
+template <typename T = void>
+class Task;
+
+namespace detail {
+
+struct TaskPromiseBase
+{
+  coroutine_handle<> continuation = noop_coroutine();
+  exception_ptr error;
+
+  // resume whoever awaited the task
+  struct FinalAwaiter
+  {
+    bool await_ready() noexcept { return false; }
+    template <typename P>
+    coroutine_handle<> await_suspend(coroutine_handle<P> h) noexcept { return h.promise().continuation; }
+    void await_resume() noexcept {}
+  };
+
+  suspend_always initial_suspend() noexcept { return {}; }
+  FinalAwaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { error = current_exception(); }
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase
+{
+  optional<T> value;
+
+  Task<T> get_return_object();
+  template <typename U>
+  void return_value(U &&v) { value.emplace(forward<U>(v)); }
+
+  T result()
+  {
+    if (error) {
+      rethrow_exception(error);
+    }
+    return move(*value);
+  }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase
+{
+  Task<void> get_return_object();
+  void return_void() {}
+
+  void result()
+  {
+    if (error) {
+      rethrow_exception(error);
+    }
+  }
+};
+
+}
+
+template <typename T>
+class Task
+{
+  public:
+    using promise_type = detail::TaskPromise<T>;
+
+  private:
+    coroutine_handle<promise_type> h;
+
+  public:
+    explicit Task(coroutine_handle<promise_type> h) : h{h} {}
+    Task(Task &&t) noexcept : h{exchange(t.h, nullptr)} {}
+    Task& operator=(Task &&t) noexcept
+    {
+      if (this != &t) {
+        if (h) {
+          h.destroy();
+        }
+        h = exchange(t.h, nullptr);
+      }
+      return *this;
+    }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task()
+    {
+      if (h) {
+        h.destroy();
+      }
+    }
+
+    bool await_ready() const noexcept { return !h || h.done(); }
+
+    coroutine_handle<> await_suspend(coroutine_handle<> awaiting) noexcept
+    {
+      h.promise().continuation = awaiting;
+      return h;
+    }
+
+    T await_resume() { return h.promise().result(); }
+};
+
+namespace detail {
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object() { return Task<T>(coroutine_handle<TaskPromise<T>>::from_promise(*this)); }
+
+inline Task<void> TaskPromise<void>::get_return_object() { return Task<void>(coroutine_handle<TaskPromise<void>>::from_promise(*this)); }
+
+// owns itself, the frame is freed when the coroutine finishes
+struct Detached
+{
+  struct promise_type
+  {
+    Detached get_return_object() { return {}; }
+    suspend_never initial_suspend() noexcept { return {}; }
+    suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    // detach() catches SocketError, anything else would be lost with the frame
+    void unhandled_exception()
+    {
+      try
+      {
+        throw;
+      }
+      catch (exception& e)
+      {
+        TCP_LOG_ERROR("Detached task error: " << e.what());
+      }
+      catch (...)
+      {
+        TCP_LOG_ERROR("Detached task error: unknown exception");
+      }
+    }
+  };
+};
+
+inline Detached detach(Task<void> t)
+{
+  try
+  {
+    co_await t;
+  }
+  catch (SocketError& e)
+  {
+    TCP_LOG_ERROR("Session Error: " << e.what());
+  }
+}
+
+}
+
+// run a task to completion in the background, an exception it throws is logged and ends only that task
+inline void Spawn(Task<void> t)
+{
+  detail::detach(move(t));
+}
+
+/*
+ * Non-blocking socket registered on an EventLoop. Read/Send try the syscall first and only suspend
+ * on EAGAIN until epoll reports the socket ready again. At most one Read and one Send may be pending.
+ */
+class AsyncSocket
+{
+  struct State
+  {
+    EventLoop *loop;
+    int fd;
+    coroutine_handle<> reader, writer;
+  };
+
+  unique_ptr<State> s;
+
+  struct Ready
+  {
+    coroutine_handle<> &waiter;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(coroutine_handle<> h) noexcept { waiter = h; }
+    void await_resume() const noexcept {}
+  };
+
+  // getaddrinfo on an Executor thread, the coroutine resumes on the loop with the addresses or the error
+  struct Resolving
+  {
+    EventLoop &loop;
+    string host;
+    int port;
+    vector<Address> addrs;
+    exception_ptr error;
+
+    Resolving(EventLoop &loop, const string &host, const int port) : loop(loop), host{host}, port{port} {}
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(coroutine_handle<> h)
+    {
+      Executor::Default().Post([this, h]
+      {
+        try
+        {
+          addrs = Resolver::Default().Resolve(host, port);
+        }
+        catch (...)
+        {
+          error = current_exception();
+        }
+        loop.Post([h] { h.resume(); });
+      });
+    }
+    vector<Address> await_resume()
+    {
+      if (error) {
+        rethrow_exception(error);
+      }
+      return move(addrs);
+    }
+  };
+
+  static void resume(State *st, const uint32_t ev)
+  {
+    coroutine_handle<> r, w;
+    if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+      r = exchange(st->reader, nullptr);
+    }
+    if (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+      w = exchange(st->writer, nullptr);
+    }
+    // the reader may finish its session and free st, so nothing touches st after this point
+    if (r) {
+      r.resume();
+    }
+    if (w) {
+      w.resume();
+    }
+  }
+
+  public:
+    AsyncSocket(EventLoop &loop, const int fd) : s{new State{&loop, fd, nullptr, nullptr}}
+    {
+      if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+        throw SocketError();
+      }
+      State *st = s.get();
+      loop.Add(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, [st] (uint32_t ev) { resume(st, ev); });
+    }
+    AsyncSocket(AsyncSocket&&) = default;
+    AsyncSocket& operator=(AsyncSocket &&o)
+    {
+      Close();
+      s = move(o.s);
+      return *this;
+    }
+    AsyncSocket(const AsyncSocket&) = delete;
+    AsyncSocket& operator=(const AsyncSocket&) = delete;
+
+    ~AsyncSocket() { Close(); }
+
+    // non-blocking connect, the coroutine resumes once the handshake has completed
+    // addresses come from the Resolver cache and are tried in turn until one answers, a name that is
+    // not cached is resolved on the Executor so getaddrinfo never blocks the loop
+    // timeout bounds the handshakes in milliseconds (-1 waits for the kernel), ETIMEDOUT once it passes
+    static Task<AsyncSocket> Connect(EventLoop &loop, const int port, const string ip = "127.0.0.1", const int timeout = 5000)
+    {
+      vector<Address> addrs;
+      if (!Resolver::Default().Lookup(ip, port, addrs)) {
+        Resolving r(loop, ip, port);
+        addrs = co_await r;
+      }
+      int err = ECONNREFUSED;
+      bool expired = false;
+      coroutine_handle<> *pending = nullptr;
+      // resumes the pending handshake from a deferred task, the timer may not be destroyed inside its own callback
+      TimerWheel::Timer deadline([&]
+      {
+        expired = true;
+        if (pending && *pending) {
+          loop.Defer([h = exchange(*pending, nullptr)] { h.resume(); });
+        }
+      });
+      if (timeout >= 0) {
+        loop.Timers().Schedule(deadline, timeout);
+      }
+      for (const Address &a : addrs) {
+        if (expired) {
+          err = ETIMEDOUT;
+          break;
+        }
+        int fd = socket(a.Family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+          throw SocketError();
+        }
+        AsyncSocket sock(loop, fd);
+        if (connect(fd, (const struct sockaddr *) &a.addr, a.len) < 0) {
+          if (errno != EINPROGRESS) {
+            err = errno;
+            continue;
+          }
+          pending = &sock.s->writer;
+          co_await Ready{sock.s->writer};
+          pending = nullptr;
+          if (expired) {
+            err = ETIMEDOUT;
+            break;
+          }
+          socklen_t len = sizeof err;
+          getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+          if (err) {
+            continue;
+          }
+        }
+        co_return move(sock);
+      }
+      Resolver::Default().Forget(ip, port);
+      errno = err;
+      throw SocketError();
+    }
+
+    int Fd() const { return s ? s->fd : -1; }
+    bool IsOpen() const { return s != nullptr; }
+
+    // bytes read into b, 0 when the peer has closed
+    Task<size_t> Read(MutableBuffer b)
+    {
+      for (;;) {
+        ssize_t n = recv(s->fd, b.data, b.size, 0);
+        if (n >= 0) {
+          co_return static_cast<size_t>(n);
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          co_await Ready{s->reader};
+        }
+        else if (errno != EINTR) {
+          throw SocketError();
+        }
+      }
+    }
+
+    // whatever arrives next, up to bufsize bytes, empty when the peer has closed
+    Task<string> Read(const size_t bufsize = 4096)
+    {
+      string data(bufsize, '\0');
+      size_t n = co_await Read(MutableBuffer(data));
+      data.resize(n);
+      co_return data;
+    }
+
+    // suspends until every byte has been handed to the kernel
+    Task<size_t> Send(ConstBuffer b)
+    {
+      size_t sent = 0;
+      while (sent < b.size) {
+        ssize_t n = send(s->fd, b.data + sent, b.size - sent, MSG_NOSIGNAL);
+        if (n >= 0) {
+          sent += n;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          co_await Ready{s->writer};
+        }
+        else if (errno != EINTR) {
+          throw SocketError();
+        }
+      }
+      co_return sent;
+    }
+
+    // keeps a copy, so a temporary string can be passed
+    Task<size_t> Send(string msg)
+    {
+      co_return co_await Send(ConstBuffer(msg));
+    }
+
+    // must not be called while a Read or Send is pending
+    void Close()
+    {
+      if (s) {
+        s->loop->Remove(s->fd);
+        close(s->fd);
+        s.reset();
+      }
+    }
+};
+
+// non-blocking listening socket, Accept() suspends until a client connects
+class AsyncListener
+{
+  static const int AcceptRetryMs = 100;
+
+  EventLoop &loop;
+  int fd;
+  coroutine_handle<> waiter;
+  TimerWheel::Timer acceptRetry;
+
+  void wakeUp()
+  {
+    if (waiter) {
+      exchange(waiter, nullptr).resume();
+    }
+  }
+
+  struct Ready
+  {
+    AsyncListener &l;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(coroutine_handle<> h) noexcept { l.waiter = h; }
+    void await_resume() const noexcept {}
+  };
+
+  public:
+    AsyncListener(EventLoop &loop, const int port, const string ip = "0.0.0.0", const int backlog = SOMAXCONN) : loop(loop)
+    {
+      sockaddr_in addr{};
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons(port);
+      if (inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) <= 0) {
+        throw SocketError("Invalid listen address");
+      }
+      fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (fd < 0) {
+        throw SocketError();
+      }
+      int on = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+      if (::bind(fd, (struct sockaddr *) &addr, sizeof addr) < 0 || listen(fd, backlog) < 0) {
+        int e = errno;
+        close(fd);
+        errno = e;
+        throw SocketError();
+      }
+      loop.Add(fd, EPOLLIN | EPOLLET, [this] (uint32_t) { wakeUp(); });
+      acceptRetry.callback = [this] { wakeUp(); };
+    }
+    AsyncListener(const AsyncListener&) = delete;
+    AsyncListener& operator=(const AsyncListener&) = delete;
+
+    virtual ~AsyncListener()
+    {
+      loop.Remove(fd);
+      close(fd);
+    }
+
+    int Fd() const { return fd; }
+
+    Task<AsyncSocket> Accept()
+    {
+      for (;;) {
+        int c = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (c >= 0) {
+          co_return AsyncSocket(loop, c);
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          co_await Ready{*this};
+        }
+        else if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+          // the backlog stays as it is and the listener reports no new edge until the next SYN,
+          // so wait for a timer or a new connection and try again
+          if (!acceptRetry.Armed()) {
+            TCP_LOG_WARN("Accept error, retrying in " << AcceptRetryMs << " ms: " << strerror(errno));
+            loop.Timers().Schedule(acceptRetry, AcceptRetryMs);
+          }
+          co_await Ready{*this};
+        }
+        else if (errno != EINTR && errno != ECONNABORTED) {
+          throw SocketError();
+        }
+      }
+    }
+};
+
+}
+
+#endif
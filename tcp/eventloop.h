@@ -0,0 +1,232 @@
+/*
+ * Source File: eventloop.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2017 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "socketerror.h"
+#include "timerwheel.h"
+#include "pool.h"
+
+namespace Tcp {
+
+using namespace std;
+
+/*
+ * Thin epoll wrapper, one instance per thread.
+ * Every registered fd gets a handler called with the ready epoll event mask, timers run from the
+ * loop's timer wheel after each batch of events, epoll_wait sleeps no longer than the next one is due.
+ * Add/Modify/Remove/Defer/Timers must be called from the loop thread, Post and Stop from anywhere.
+ */
+class EventLoop
+{
+  public:
+    using EventHandler = function<void(uint32_t)>;
+    using Task = function<void()>;
+
+  private:
+    struct Entry
+    {
+      int fd;
+      EventHandler handler;
+      bool active;
+
+      static void* operator new(const size_t n) { return Pool::Default().Allocate(n); }
+      static void operator delete(void *p, const size_t n) { Pool::Default().Deallocate(p, n); }
+    };
+
+    int epfd, wakefd;
+    // set by Stop() and never cleared, a Stop() that arrives before Run() is not lost
+    atomic<bool> stopped{false};
+    vector<epoll_event> events;
+    PoolMap<int, unique_ptr<Entry>> entries;
+    // entries removed while a batch is being dispatched, freed after the batch
+    vector<unique_ptr<Entry>> removed;
+    vector<Task> deferred, posted;
+    vector<Task> batch; // tasks being run, keeps its capacity so a steady loop allocates nothing
+    mutex postLock;
+    TimerWheel timers;
+
+    void wake()
+    {
+      uint64_t one = 1;
+      ssize_t n = write(wakefd, &one, sizeof one);
+      (void)n;
+    }
+
+    void runTasks()
+    {
+      // deferred tasks may defer more tasks, run until the queue is empty
+      while (!deferred.empty()) {
+        batch.swap(deferred);
+        for (auto &t : batch) t();
+        batch.clear();
+      }
+      {
+        lock_guard<mutex> lk(postLock);
+        batch.swap(posted);
+      }
+      for (auto &t : batch) t();
+      batch.clear();
+    }
+
+  public:
+    explicit EventLoop(const int maxEvents = 1024) : events(maxEvents)
+    {
+      epfd = epoll_create1(EPOLL_CLOEXEC);
+      if (epfd < 0) {
+        throw SocketError();
+      }
+      wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (wakefd < 0) {
+        close(epfd);
+        throw SocketError();
+      }
+      Add(wakefd, EPOLLIN | EPOLLET, [this] (uint32_t)
+      {
+        uint64_t n;
+        while (read(wakefd, &n, sizeof n) > 0) {}
+      });
+    }
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    virtual ~EventLoop()
+    {
+      close(wakefd);
+      close(epfd);
+    }
+
+    void Add(const int fd, const uint32_t ev, EventHandler handler)
+    {
+      unique_ptr<Entry> e(new Entry{fd, move(handler), true});
+      epoll_event ee{};
+      ee.events = ev;
+      ee.data.ptr = e.get();
+      if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ee) < 0) {
+        throw SocketError();
+      }
+      entries[fd] = move(e);
+    }
+
+    void Modify(const int fd, const uint32_t ev)
+    {
+      auto it = entries.find(fd);
+      if (it == entries.end()) {
+        return;
+      }
+      epoll_event ee{};
+      ee.events = ev;
+      ee.data.ptr = it->second.get();
+      if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ee) < 0) {
+        throw SocketError();
+      }
+    }
+
+    // the epoll fd, readable whenever the loop has events, lets another poller wait on the loop
+    int Fd() const { return epfd; }
+
+    // call before closing fd
+    void Remove(const int fd)
+    {
+      auto it = entries.find(fd);
+      if (it == entries.end()) {
+        return;
+      }
+      epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+      it->second->active = false;
+      removed.push_back(move(it->second));
+      entries.erase(it);
+    }
+
+    // run a task on the loop thread after the current batch of events
+    void Defer(Task t)
+    {
+      deferred.push_back(move(t));
+    }
+
+    // per-loop timers, e.g. loop.Timers().Schedule(timer, 30000)
+    TimerWheel& Timers() { return timers; }
+
+    // thread-safe, wakes the loop up
+    void Post(Task t)
+    {
+      {
+        lock_guard<mutex> lk(postLock);
+        posted.push_back(move(t));
+      }
+      wake();
+    }
+
+    // wait up to timeout milliseconds (-1 blocks) and dispatch one batch of events
+    int RunOnce(const int timeout = -1)
+    {
+      int wait = deferred.empty() ? timeout : 0;
+      int due = timers.NextTimeout();
+      if (due >= 0 && (wait < 0 || due < wait)) {
+        wait = due;
+      }
+      int n = epoll_wait(epfd, events.data(), static_cast<int>(events.size()), wait);
+      if (n < 0) {
+        if (errno != EINTR) {
+          throw SocketError();
+        }
+        n = 0;
+      }
+      for (int i = 0; i < n; i++) {
+        Entry *e = static_cast<Entry*>(events[i].data.ptr);
+        if (e->active) {
+          e->handler(events[i].events);
+        }
+      }
+      if (!timers.Empty()) {
+        timers.Advance();
+      }
+      runTasks();
+      removed.clear();
+      return n;
+    }
+
+    // run due timers, deferred and posted tasks without asking epoll, for a loop whose epoll fd is
+    // watched by another poller that reported nothing
+    void RunPending()
+    {
+      if (!timers.Empty()) {
+        timers.Advance();
+      }
+      runTasks();
+      removed.clear();
+    }
+
+    // events one RunOnce() dispatches at most, a full batch may leave more ready
+    size_t MaxEvents() const { return events.size(); }
+
+    void Run()
+    {
+      while (!stopped) {
+        RunOnce(-1);
+      }
+    }
+
+    void Stop()
+    {
+      stopped = true;
+      wake();
+    }
+
+    bool IsRunning() const { return !stopped; }
+};
+
+}
@@ -0,0 +1,98 @@
+/*
+ * Source File: executor.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2017 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Tcp {
+
+using namespace std;
+
+/*
+ * Fixed pool of threads started once and reused for the completion callbacks of SendAsync()/ReadAsync()
+ * and other posted work, so no thread is created per message.
+ */
+class Executor
+{
+  public:
+    using Task = function<void()>;
+
+  private:
+    vector<thread> workers;
+    mutex m;
+    condition_variable cv;
+    deque<Task> tasks;
+    bool stopping = false;
+
+    void work()
+    {
+      for (;;) {
+        Task t;
+        {
+          unique_lock<mutex> lk(m);
+          cv.wait(lk, [this] { return stopping || !tasks.empty(); });
+          if (tasks.empty()) {
+            return;
+          }
+          t = move(tasks.front());
+          tasks.pop_front();
+        }
+        t();
+      }
+    }
+
+  public:
+    // threads = 0 picks one thread per core, at least 4 since callbacks may block
+    explicit Executor(unsigned threads = 0)
+    {
+      if (!threads) {
+        threads = max(4u, thread::hardware_concurrency());
+      }
+      for (unsigned i = 0; i < threads; i++) {
+        workers.emplace_back([this] { work(); });
+      }
+    }
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+
+    // runs the tasks already queued, then joins the threads
+    virtual ~Executor()
+    {
+      {
+        lock_guard<mutex> lk(m);
+        stopping = true;
+      }
+      cv.notify_all();
+      for (auto &w : workers) {
+        w.join();
+      }
+    }
+
+    void Post(Task t)
+    {
+      {
+        lock_guard<mutex> lk(m);
+        tasks.push_back(move(t));
+      }
+      cv.notify_one();
+    }
+
+    size_t Threads() const { return workers.size(); }
+
+    // process wide pool used by Server, Client and AsyncSocket::Connect()
+    static Executor& Default()
+    {
+      static Executor ex;
+      return ex;
+    }
+};
+
+}
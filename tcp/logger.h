@@ -0,0 +1,259 @@
+/*
+ * Source File: logger.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2017 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+// messages below this level are compiled out: 0 debug, 1 info, 2 warn, 3 error, 4 nothing
+#ifndef TCP_LOG_LEVEL
+#define TCP_LOG_LEVEL 1
+#endif
+
+namespace Tcp {
+
+using namespace std;
+
+/*
+ * Asynchronous logger. Write() copies the message into a lock-free ring and returns, a background
+ * thread hands the messages to the sink, so a slow terminal or pipe never stalls an I/O thread.
+ * When the ring is full the message is dropped and counted instead of blocking.
+ */
+class Logger
+{
+  public:
+    enum Level { Debug, Info, Warn, Error, Off };
+    using Sink = function<void(Level, const char*, size_t)>;
+
+  private:
+    static const size_t MaxMessage = 240;
+
+    struct Slot
+    {
+      atomic<size_t> seq;
+      Level level;
+      size_t len;
+      char text[MaxMessage];
+    };
+
+    // bounded multi-producer queue (Vyukov), each slot's sequence number says whose turn it is
+    unique_ptr<Slot[]> slots;
+    size_t mask;
+    atomic<size_t> head{0}, tail{0};
+    atomic<uint64_t> dropped{0};
+    atomic<int> level{TCP_LOG_LEVEL};
+
+    mutex sinkLock;
+    Sink sink;
+    mutex m;
+    condition_variable cv;
+    atomic<bool> idle{false}, stopping{false};
+    thread worker;
+
+    // false when the message was taken, single consumer
+    bool pop()
+    {
+      size_t pos = tail.load(memory_order_relaxed);
+      Slot &s = slots[pos & mask];
+      if (s.seq.load(memory_order_acquire) != pos + 1) {
+        return false;
+      }
+      sink(s.level, s.text, s.len);
+      s.seq.store(pos + mask + 1, memory_order_release);
+      tail.store(pos + 1, memory_order_relaxed);
+      return true;
+    }
+
+    void drain()
+    {
+      lock_guard<mutex> lk(sinkLock);
+      while (pop()) {}
+      fflush(stdout);
+      fflush(stderr);
+    }
+
+    // the next message is complete, single consumer
+    bool ready() const
+    {
+      size_t pos = tail.load(memory_order_relaxed);
+      return slots[pos & mask].seq.load(memory_order_acquire) == pos + 1;
+    }
+
+    // the fence orders idle before the slot check, Write() fences between its slot store and idle
+    // so either the worker sees the message or the producer sees idle and notifies under the lock
+    void work()
+    {
+      for (;;) {
+        drain();
+        unique_lock<mutex> lk(m);
+        idle.store(true, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        cv.wait(lk, [this] { return stopping || ready(); });
+        idle.store(false, memory_order_relaxed);
+        if (stopping) {
+          break;
+        }
+      }
+      drain();
+    }
+
+    static void console(Level l, const char *text, size_t len)
+    {
+      FILE *f = l >= Warn ? stderr : stdout;
+      fwrite(text, 1, len, f);
+      fputc('\n', f);
+    }
+
+  public:
+    // capacity is rounded up to a power of two
+    explicit Logger(size_t capacity = 4096) : sink(console)
+    {
+      size_t n = 2;
+      while (n < capacity) {
+        n <<= 1;
+      }
+      slots.reset(new Slot[n]);
+      mask = n - 1;
+      for (size_t i = 0; i < n; i++) {
+        slots[i].seq.store(i, memory_order_relaxed);
+      }
+      worker = thread([this] { work(); });
+    }
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    // delivers every queued message before returning
+    virtual ~Logger()
+    {
+      {
+        lock_guard<mutex> lk(m);
+        stopping = true;
+      }
+      cv.notify_one();
+      worker.join();
+    }
+
+    bool Enabled(const Level l) const { return l >= level.load(memory_order_relaxed); }
+
+    // runtime threshold, messages below TCP_LOG_LEVEL are already gone at compile time
+    void SetLevel(const Level l) { level = l; }
+
+    // replaces the default stdout/stderr sink, the sink is called on the logger thread
+    void SetSink(Sink s)
+    {
+      lock_guard<mutex> lk(sinkLock);
+      sink = s ? move(s) : Sink(console);
+    }
+
+    uint64_t Dropped() const { return dropped.load(memory_order_relaxed); }
+
+    // never blocks, messages longer than 240 bytes are truncated
+    void Write(const Level l, const char *text, size_t len)
+    {
+      if (!Enabled(l)) {
+        return;
+      }
+      size_t pos = head.load(memory_order_relaxed);
+      Slot *s;
+      for (;;) {
+        s = &slots[pos & mask];
+        size_t seq = s->seq.load(memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+          if (head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+            break;
+          }
+        }
+        else if (diff < 0) {
+          dropped.fetch_add(1, memory_order_relaxed);
+          return;
+        }
+        else {
+          pos = head.load(memory_order_relaxed);
+        }
+      }
+      s->level = l;
+      s->len = len < MaxMessage ? len : MaxMessage;
+      memcpy(s->text, text, s->len);
+      s->seq.store(pos + 1, memory_order_release);
+      atomic_thread_fence(memory_order_seq_cst);
+      if (idle.load(memory_order_relaxed)) {
+        lock_guard<mutex> lk(m);
+        cv.notify_one();
+      }
+    }
+
+    void Write(const Level l, const string &msg) { Write(l, msg.data(), msg.size()); }
+
+    // wait until everything queued so far has reached the sink
+    void Flush()
+    {
+      size_t target = head.load(memory_order_acquire);
+      while (tail.load(memory_order_acquire) < target) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+      }
+      lock_guard<mutex> lk(sinkLock);
+    }
+
+    // process wide logger used by Server and Client
+    static Logger& Default()
+    {
+      static Logger log;
+      return log;
+    }
+};
+
+}
+
+// stream style, e.g. TCP_LOG_ERROR("Server Read Error: " << e.what()); the message is only formatted when enabled
+#define TCP_LOG(lvl, expr) \
+  do { \
+    if (Tcp::Logger::Default().Enabled(lvl)) { \
+      std::ostringstream tcp_log_os; \
+      tcp_log_os << expr; \
+      Tcp::Logger::Default().Write(lvl, tcp_log_os.str()); \
+    } \
+  } while (0)
+
+// a level compiled out still type-checks its operands, so locals only logged stay used, but never evaluates them
+#define TCP_LOG_NONE(expr) \
+  do { \
+    if (false) { \
+      std::ostringstream tcp_log_os; \
+      tcp_log_os << expr; \
+    } \
+  } while (0)
+
+#if TCP_LOG_LEVEL <= 0
+#define TCP_LOG_DEBUG(expr) TCP_LOG(Tcp::Logger::Debug, expr)
+#else
+#define TCP_LOG_DEBUG(expr) TCP_LOG_NONE(expr)
+#endif
+#if TCP_LOG_LEVEL <= 1
+#define TCP_LOG_INFO(expr) TCP_LOG(Tcp::Logger::Info, expr)
+#else
+#define TCP_LOG_INFO(expr) TCP_LOG_NONE(expr)
+#endif
+#if TCP_LOG_LEVEL <= 2
+#define TCP_LOG_WARN(expr) TCP_LOG(Tcp::Logger::Warn, expr)
+#else
+#define TCP_LOG_WARN(expr) TCP_LOG_NONE(expr)
+#endif
+#if TCP_LOG_LEVEL <= 3
+#define TCP_LOG_ERROR(expr) TCP_LOG(Tcp::Logger::Error, expr)
+#else
+#define TCP_LOG_ERROR(expr) TCP_LOG_NONE(expr)
+#endif
@@ -0,0 +1,313 @@
+/*
+ * Source File: metrics.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2017 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <sstream>
+#include <string>
+#include "pool.h"
+
+namespace Tcp {
+
+using namespace std;
+
+/*
+ * Power-of-two bucketed histogram, bucket b counts values in [2^(b-1), 2^b).
+ * Record() is two relaxed atomic adds, so it can stay on the hot path of every thread.
+ */
+class Histogram
+{
+  public:
+    static const int Buckets = 64;
+
+    struct Snapshot
+    {
+      uint64_t counts[Buckets]{};
+      uint64_t count = 0, sum = 0;
+
+      double Mean() const { return count ? double(sum) / count : 0; }
+
+      // upper bound of the bucket holding the p-th value, p in [0, 1]
+      uint64_t Percentile(const double p) const
+      {
+        if (!count) {
+          return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(p * (count - 1)) + 1, seen = 0;
+        for (int b = 0; b < Buckets; b++) {
+          seen += counts[b];
+          if (seen >= rank) {
+            return b ? (uint64_t(1) << b) - 1 : 0;
+          }
+        }
+        return UINT64_MAX;
+      }
+    };
+
+  private:
+    atomic<uint64_t> counts[Buckets];
+    atomic<uint64_t> sum;
+
+    static int bucket(const uint64_t v) { return v ? min(Buckets - 1, 64 - __builtin_clzll(v)) : 0; }
+
+  public:
+    Histogram() { Reset(); }
+    Histogram(const Histogram&) = delete;
+    Histogram& operator=(const Histogram&) = delete;
+
+    void Record(const uint64_t v)
+    {
+      counts[bucket(v)].fetch_add(1, memory_order_relaxed);
+      sum.fetch_add(v, memory_order_relaxed);
+    }
+
+    Snapshot Snap() const
+    {
+      Snapshot s;
+      for (int b = 0; b < Buckets; b++) {
+        s.counts[b] = counts[b].load(memory_order_relaxed);
+        s.count += s.counts[b];
+      }
+      s.sum = sum.load(memory_order_relaxed);
+      return s;
+    }
+
+    void Reset()
+    {
+      for (auto &c : counts) {
+        c.store(0, memory_order_relaxed);
+      }
+      sum.store(0, memory_order_relaxed);
+    }
+};
+
+/*
+ * Counters and histograms for one Server or Client, including the connections of its Serve() loops.
+ * Every thread that records gets its own shard, taken from the pool so it never shares a cache line
+ * with another, and the Serve() workers update their own counters without contending. Snap() and
+ * Export() sum the shards and can be called from any thread.
+ */
+class Metrics
+{
+  public:
+    struct Snapshot
+    {
+      uint64_t bytesIn = 0, bytesOut = 0;
+      uint64_t recvCalls = 0, sendCalls = 0;
+      uint64_t pollTimeouts = 0;   // Read/ReadAsync waits that ended without data
+      uint64_t wouldBlock = 0;     // recv/send that returned EAGAIN
+      uint64_t shortWrites = 0;    // sends that left bytes queued for later
+      uint64_t accepts = 0, disconnects = 0, errors = 0;
+      uint64_t rejects = 0;        // connections closed on accept, over the connection limit
+      uint64_t timeouts = 0;       // connections closed by an idle, read or write deadline
+      Histogram::Snapshot readSize;    // bytes per successful recv
+      Histogram::Snapshot serviceTime; // microseconds from request read to response sent, or per onRead call
+    };
+
+    // threads beyond this many share shards round-robin
+    static const int MaxShards = 64;
+
+  private:
+    struct Shard
+    {
+      atomic<uint64_t> bytesIn{0}, bytesOut{0}, recvCalls{0}, sendCalls{0}, pollTimeouts{0};
+      atomic<uint64_t> wouldBlock{0}, shortWrites{0}, accepts{0}, disconnects{0}, errors{0};
+      atomic<uint64_t> rejects{0}, timeouts{0};
+      Histogram readSize, serviceTime;
+
+      void Reset()
+      {
+        for (auto c : {&bytesIn, &bytesOut, &recvCalls, &sendCalls, &pollTimeouts, &wouldBlock, &shortWrites, &accepts, &disconnects, &errors, &rejects, &timeouts}) {
+          c->store(0, memory_order_relaxed);
+        }
+        readSize.Reset();
+        serviceTime.Reset();
+      }
+    };
+
+    atomic<Shard*> shards[MaxShards];
+
+    static void add(atomic<uint64_t> &c, const uint64_t n = 1) { c.fetch_add(n, memory_order_relaxed); }
+    static uint64_t get(const atomic<uint64_t> &c) { return c.load(memory_order_relaxed); }
+
+    static void sum(Histogram::Snapshot &to, const Histogram::Snapshot &h)
+    {
+      for (int b = 0; b < Histogram::Buckets; b++) {
+        to.counts[b] += h.counts[b];
+      }
+      to.count += h.count;
+      to.sum += h.sum;
+    }
+
+    // the calling thread's shard, created on its first update
+    Shard& shard()
+    {
+      static atomic<unsigned> threads{0};
+      static thread_local unsigned slot = threads.fetch_add(1, memory_order_relaxed) % MaxShards;
+      Shard *s = shards[slot].load(memory_order_acquire);
+      if (!s) {
+        Shard *n = new (Pool::Default().Allocate(sizeof(Shard))) Shard;
+        if (shards[slot].compare_exchange_strong(s, n, memory_order_acq_rel)) {
+          s = n;
+        }
+        else {
+          n->~Shard();
+          Pool::Default().Deallocate(n, sizeof(Shard));
+        }
+      }
+      return *s;
+    }
+
+  public:
+    Metrics()
+    {
+      for (auto &s : shards) {
+        s.store(nullptr, memory_order_relaxed);
+      }
+    }
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+    ~Metrics()
+    {
+      for (auto &p : shards) {
+        if (Shard *s = p.load(memory_order_relaxed)) {
+          s->~Shard();
+          Pool::Default().Deallocate(s, sizeof(Shard));
+        }
+      }
+    }
+
+    // result of one recv call, errno is only looked at when n < 0
+    void Received(const ssize_t n)
+    {
+      Shard &m = shard();
+      add(m.recvCalls);
+      if (n > 0) {
+        add(m.bytesIn, n);
+        m.readSize.Record(n);
+      }
+      else if (n < 0) {
+        add(errno == EAGAIN || errno == EWOULDBLOCK ? m.wouldBlock : m.errors);
+      }
+    }
+
+    // result of one send call, queued is what is left for a later flush
+    void Sent(const ssize_t n, const size_t queued)
+    {
+      Shard &m = shard();
+      add(m.sendCalls);
+      if (n > 0) {
+        add(m.bytesOut, n);
+      }
+      else if (n == 0) {
+        add(m.wouldBlock);
+      }
+      else {
+        add(m.errors);
+      }
+      if (n >= 0 && queued) {
+        add(m.shortWrites);
+      }
+    }
+
+    void PollTimeout() { add(shard().pollTimeouts); }
+    void Accepted() { add(shard().accepts); }
+    void Disconnected() { add(shard().disconnects); }
+    void Error() { add(shard().errors); }
+    void Rejected() { add(shard().rejects); }
+    void TimedOut() { add(shard().timeouts); }
+
+    void Service(const chrono::steady_clock::time_point since)
+    {
+      shard().serviceTime.Record(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - since).count());
+    }
+
+    Snapshot Snap() const
+    {
+      Snapshot s;
+      for (auto &p : shards) {
+        const Shard *m = p.load(memory_order_acquire);
+        if (!m) {
+          continue;
+        }
+        s.bytesIn += get(m->bytesIn);
+        s.bytesOut += get(m->bytesOut);
+        s.recvCalls += get(m->recvCalls);
+        s.sendCalls += get(m->sendCalls);
+        s.pollTimeouts += get(m->pollTimeouts);
+        s.wouldBlock += get(m->wouldBlock);
+        s.shortWrites += get(m->shortWrites);
+        s.accepts += get(m->accepts);
+        s.disconnects += get(m->disconnects);
+        s.errors += get(m->errors);
+        s.rejects += get(m->rejects);
+        s.timeouts += get(m->timeouts);
+        sum(s.readSize, m->readSize.Snap());
+        sum(s.serviceTime, m->serviceTime.Snap());
+      }
+      return s;
+    }
+
+    // Prometheus text exposition format, each metric named prefix_<name> after its # TYPE line, buckets stop at the largest value seen
+    string Export(const string prefix = "tcp") const
+    {
+      Snapshot s = Snap();
+      ostringstream o;
+      auto counter = [&] (const char *name, const uint64_t v)
+      {
+        o << "# TYPE " << prefix << "_" << name << " counter\n";
+        o << prefix << "_" << name << " " << v << "\n";
+      };
+      auto histogram = [&] (const char *name, const Histogram::Snapshot &h)
+      {
+        o << "# TYPE " << prefix << "_" << name << " histogram\n";
+        uint64_t cum = 0;
+        for (int b = 0; b < Histogram::Buckets; b++) {
+          cum += h.counts[b];
+          o << prefix << "_" << name << "_bucket{le=\"" << (b ? (uint64_t(1) << b) - 1 : 0) << "\"} " << cum << "\n";
+          if (cum == h.count) {
+            break;
+          }
+        }
+        o << prefix << "_" << name << "_bucket{le=\"+Inf\"} " << h.count << "\n";
+        o << prefix << "_" << name << "_sum " << h.sum << "\n";
+        o << prefix << "_" << name << "_count " << h.count << "\n";
+      };
+      counter("bytes_in_total", s.bytesIn);
+      counter("bytes_out_total", s.bytesOut);
+      counter("recv_calls_total", s.recvCalls);
+      counter("send_calls_total", s.sendCalls);
+      counter("poll_timeouts_total", s.pollTimeouts);
+      counter("would_block_total", s.wouldBlock);
+      counter("short_writes_total", s.shortWrites);
+      counter("accepts_total", s.accepts);
+      counter("disconnects_total", s.disconnects);
+      counter("errors_total", s.errors);
+      counter("rejects_total", s.rejects);
+      counter("timeouts_total", s.timeouts);
+      histogram("read_size_bytes", s.readSize);
+      histogram("service_time_us", s.serviceTime);
+      return o.str();
+    }
+
+    void Reset()
+    {
+      for (auto &p : shards) {
+        if (Shard *m = p.load(memory_order_acquire)) {
+          m->Reset();
+        }
+      }
+    }
+};
+
+}
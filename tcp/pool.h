@@ -0,0 +1,269 @@
+/*
+ * Source File: pool.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2017 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+
+namespace Tcp {
+
+using namespace std;
+
+// slow path counters of the pool, with a steady load arenas and oversize stop growing
+struct PoolStats
+{
+  uint64_t arenas = 0;      // 2 MiB arenas mapped, every one is a trip to the kernel
+  uint64_t hugeArenas = 0;  // of those backed by MAP_HUGETLB pages
+  uint64_t arenaBytes = 0;
+  uint64_t refills = 0;     // thread caches refilled from the shared lists
+  uint64_t flushes = 0;     // thread caches that gave slots back to the shared lists
+  uint64_t oversize = 0;    // blocks above MaxSize, passed on to operator new
+};
+
+/*
+ * Size class slab allocator for connection state and I/O buffers. Blocks of 64 B up to 1 MiB are
+ * rounded up to a power of two and carved from 2 MiB arenas, so every slot is cache-line aligned and
+ * never shares a line with another slot. Each thread keeps its own free lists and only takes the lock
+ * of a size class to move a batch of slots between its cache and the shared list, a thread that frees
+ * what another allocated simply keeps the slot. Arenas are never unmapped: after warm-up connection
+ * churn reuses slots and does no malloc/free or mmap at all.
+ * Callers pass the size back on Deallocate(), like sized delete, so slots carry no header.
+ */
+class Pool
+{
+  public:
+    static const size_t MinSize = 64;
+    static const size_t MaxSize = 1 << 20;
+    static const size_t ArenaSize = 2 << 20;
+    static const int Classes = 15; // 64 B .. 1 MiB
+
+  private:
+    struct Slot
+    {
+      Slot *next;
+    };
+
+    struct Class
+    {
+      mutex m;
+      Slot *free = nullptr;
+      char *cur = nullptr, *end = nullptr; // uncarved rest of the last arena
+    };
+
+    struct Cache
+    {
+      Slot *free[Classes]{};
+      size_t count[Classes]{};
+
+      // a thread that ends hands its slots to the other threads
+      ~Cache()
+      {
+        for (int c = 0; c < Classes; c++) {
+          if (count[c]) {
+            Default().flush(*this, c, count[c]);
+          }
+        }
+      }
+    };
+
+    Class classes[Classes];
+    atomic<bool> huge{false};
+    atomic<uint64_t> arenas{0}, hugeArenas{0}, arenaBytes{0}, refills{0}, flushes{0}, oversize{0};
+
+    Pool() {}
+
+    static int classOf(const size_t n)
+    {
+      return n <= MinSize ? 0 : 64 - __builtin_clzll(n - 1) - 6;
+    }
+
+    static size_t sizeOf(const int c) { return MinSize << c; }
+
+    // slots moved between a thread cache and the shared list at once, about 64 KiB worth
+    static size_t batch(const int c)
+    {
+      size_t b = (64 << 10) / sizeOf(c);
+      return b < 1 ? 1 : b > 32 ? 32 : b;
+    }
+
+    static Cache& cache()
+    {
+      static thread_local Cache c;
+      return c;
+    }
+
+    char* map(size_t &len)
+    {
+      void *p = MAP_FAILED;
+      if (huge.load(memory_order_relaxed)) {
+        p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+          hugeArenas.fetch_add(1, memory_order_relaxed);
+        }
+      }
+      if (p == MAP_FAILED) {
+        p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+          throw bad_alloc();
+        }
+#ifdef MADV_HUGEPAGE
+        // no reserved hugepages, transparent ones are still possible
+        if (huge.load(memory_order_relaxed)) {
+          madvise(p, len, MADV_HUGEPAGE);
+        }
+#endif
+      }
+      arenas.fetch_add(1, memory_order_relaxed);
+      arenaBytes.fetch_add(len, memory_order_relaxed);
+      return static_cast<char*>(p);
+    }
+
+    // move up to a batch of slots from the shared list (or a fresh arena) into the thread cache
+    void refill(Cache &tc, const int c)
+    {
+      Class &k = classes[c];
+      const size_t size = sizeOf(c), want = batch(c);
+      lock_guard<mutex> lk(k.m);
+      size_t got = 0;
+      while (got < want) {
+        Slot *s = k.free;
+        if (s) {
+          k.free = s->next;
+        }
+        else {
+          if (k.cur == k.end) {
+            size_t len = ArenaSize;
+            if (size > len) {
+              len = size;
+            }
+            k.cur = map(len);
+            k.end = k.cur + len;
+          }
+          s = reinterpret_cast<Slot*>(k.cur);
+          k.cur += size;
+        }
+        s->next = tc.free[c];
+        tc.free[c] = s;
+        got++;
+      }
+      tc.count[c] += got;
+      refills.fetch_add(1, memory_order_relaxed);
+    }
+
+    // give n slots of the thread cache back to the shared list
+    void flush(Cache &tc, const int c, size_t n)
+    {
+      Class &k = classes[c];
+      lock_guard<mutex> lk(k.m);
+      tc.count[c] -= n;
+      while (n--) {
+        Slot *s = tc.free[c];
+        tc.free[c] = s->next;
+        s->next = k.free;
+        k.free = s;
+      }
+      flushes.fetch_add(1, memory_order_relaxed);
+    }
+
+  public:
+    Pool(const Pool&) = delete;
+    Pool& operator=(const Pool&) = delete;
+
+    // n bytes aligned to the cache line (to 16 bytes above MaxSize), bad_alloc when out of memory
+    void* Allocate(const size_t n)
+    {
+      if (n > MaxSize) {
+        oversize.fetch_add(1, memory_order_relaxed);
+        return ::operator new(n);
+      }
+      const int c = classOf(n);
+      Cache &tc = cache();
+      if (!tc.free[c]) {
+        refill(tc, c);
+      }
+      Slot *s = tc.free[c];
+      tc.free[c] = s->next;
+      tc.count[c]--;
+      return s;
+    }
+
+    // n must be the size given to Allocate()
+    void Deallocate(void *p, const size_t n)
+    {
+      if (!p) {
+        return;
+      }
+      if (n > MaxSize) {
+        ::operator delete(p);
+        return;
+      }
+      const int c = classOf(n);
+      Cache &tc = cache();
+      Slot *s = static_cast<Slot*>(p);
+      s->next = tc.free[c];
+      tc.free[c] = s;
+      if (++tc.count[c] > 2 * batch(c)) {
+        flush(tc, c, batch(c));
+      }
+    }
+
+    // back new arenas with reserved hugepages (vm.nr_hugepages), falling back to transparent hugepages
+    // fewer TLB misses on the buffers of many connections, arenas mapped before keep their pages
+    void SetHugePages(const bool on) { huge.store(on, memory_order_relaxed); }
+
+    PoolStats Stats() const
+    {
+      PoolStats s;
+      s.arenas = arenas.load(memory_order_relaxed);
+      s.hugeArenas = hugeArenas.load(memory_order_relaxed);
+      s.arenaBytes = arenaBytes.load(memory_order_relaxed);
+      s.refills = refills.load(memory_order_relaxed);
+      s.flushes = flushes.load(memory_order_relaxed);
+      s.oversize = oversize.load(memory_order_relaxed);
+      return s;
+    }
+
+    // process wide pool, never destroyed so thread caches and blocks freed during exit stay valid
+    static Pool& Default()
+    {
+      static Pool *p = new Pool;
+      return *p;
+    }
+};
+
+// standard allocator on the pool, for containers and allocate_shared()
+template <typename T>
+struct PoolAllocator
+{
+  using value_type = T;
+
+  PoolAllocator() {}
+  template <typename U>
+  PoolAllocator(const PoolAllocator<U>&) {}
+
+  T* allocate(const size_t n) { return static_cast<T*>(Pool::Default().Allocate(n * sizeof(T))); }
+  void deallocate(T *p, const size_t n) { Pool::Default().Deallocate(p, n * sizeof(T)); }
+};
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&) { return false; }
+
+// fd keyed tables whose nodes come and go with the connections
+template <typename K, typename V>
+using PoolMap = unordered_map<K, V, hash<K>, equal_to<K>, PoolAllocator<pair<const K, V>>>;
+
+}
@@ -0,0 +1,300 @@
+/*
+ * Source File: reactor.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2017 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <chrono>
+#include <memory>
+#include <unordered_map>
+#include "asyncio.h"
+#include "eventloop.h"
+#include "connection.h"
+#include "logger.h"
+#include "metrics.h"
+#include "socketoptions.h"
+#include "pool.h"
+
+namespace Tcp {
+
+using namespace std;
+
+// idle, read and write deadlines in ms given to every accepted connection, 0 is off
+struct ConnectionTimeouts
+{
+  uint64_t idle = 0, read = 0, write = 0;
+
+  void Apply(Connection &c) const
+  {
+    if (idle) {
+      c.SetIdleTimeout(idle);
+    }
+    if (read) {
+      c.SetReadTimeout(read);
+    }
+    if (write) {
+      c.SetWriteTimeout(write);
+    }
+  }
+};
+
+/*
+ * Accepts connections from a non-blocking listening socket and keeps all of them
+ * open on one edge-triggered event loop. Idle connections cost nothing until epoll reports them.
+ */
+class Reactor
+{
+  protected:
+    int listenfd;
+    EventLoop loop;
+    ConnectionHandlers handlers;
+    PoolMap<int, shared_ptr<Connection>> conns;
+    Metrics *metrics;
+    SocketOptions opts;
+    size_t maxConnections = 0;
+    ConnectionTimeouts timeouts;
+    size_t highWater = 0, lowWater = 0;
+
+    // accepting again after the process ran out of descriptors or memory
+    TimerWheel::Timer acceptRetry;
+
+    // connections taken per listener wake-up before the open connections get a turn
+    static const int AcceptBatch = 256;
+    static const int AcceptRetryMs = 100;
+
+    // for backends that accept through something other than epoll
+    explicit Reactor(const ConnectionHandlers &handlers, Metrics *metrics = nullptr) : listenfd{-1}, handlers(handlers), metrics{metrics} {}
+
+    // EMFILE, ENFILE, ENOBUFS and ENOMEM leave the backlog as it is, and the listener reports no new
+    // edge until the next SYN, so count the failure and try again on a timer
+    void acceptLater(const int err)
+    {
+      if (metrics) {
+        metrics->Error();
+      }
+      if (!acceptRetry.Armed()) {
+        TCP_LOG_WARN("Reactor accept error, retrying in " << AcceptRetryMs << " ms: " << strerror(err));
+        loop.Timers().Schedule(acceptRetry, AcceptRetryMs);
+      }
+    }
+
+    // run a callback, a SocketError it throws closes only this connection instead of ending the worker loop
+    void invoke(const ConnectionHandler &h, Connection &c)
+    {
+      try
+      {
+        h(c);
+      }
+      catch (SocketError& e)
+      {
+        TCP_LOG_ERROR("Connection " << c.Peer() << " error: " << e.what());
+        if (metrics) {
+          metrics->Error();
+        }
+        c.Close();
+      }
+    }
+
+    // onRead, timed as the service time when metrics are collected
+    void serve(Connection &c)
+    {
+      if (!metrics) {
+        invoke(handlers.onRead, c);
+      }
+      else {
+        auto start = chrono::steady_clock::now();
+        invoke(handlers.onRead, c);
+        metrics->Service(start);
+      }
+      if (!c.IsClosed()) {
+        opts.Rearm(c.Fd());
+      }
+    }
+
+    // defaults of a new connection, set before onConnect so the handler can still change them
+    void setup(Connection &c)
+    {
+      timeouts.Apply(c);
+      if (highWater) {
+        c.SetWatermarks(highWater, lowWater);
+      }
+      c.OnWatermark([this, &c] (const bool high) { watermark(c, high); });
+    }
+
+    // the watermark handlers, or pause reading at high and resume at low when there are none
+    void watermark(Connection &c, const bool high)
+    {
+      const ConnectionHandler &h = high ? handlers.onHighWater : handlers.onLowWater;
+      if (h) {
+        invoke(h, c);
+      }
+      else if (high) {
+        c.PauseReading();
+      }
+      else {
+        c.ResumeReading();
+      }
+    }
+
+    // admission control, a connection over the limit is closed right after accept
+    // so the backlog keeps draining and the client fails fast instead of retrying its SYN
+    bool admit(const int fd)
+    {
+      if (!maxConnections || conns.size() < maxConnections) {
+        return true;
+      }
+      close(fd);
+      if (metrics) {
+        metrics->Rejected();
+      }
+      return false;
+    }
+
+    // forget a closed connection, run onClose and close the socket
+    void release(const int fd)
+    {
+      auto it = conns.find(fd);
+      if (it == conns.end()) {
+        return;
+      }
+      auto conn = it->second;
+      conns.erase(it);
+      if (metrics) {
+        metrics->Disconnected();
+      }
+      if (handlers.onClose) {
+        invoke(handlers.onClose, *conn);
+      }
+      if (conn->zc.Retire(fd)) {
+        IoLoop::Default().SweepRetired();
+      }
+      close(fd);
+    }
+
+  private:
+    // drain the backlog until EAGAIN, a burst larger than AcceptBatch continues after the pending events
+    void acceptAll()
+    {
+      for (int taken = 0; ; taken++) {
+        if (taken == AcceptBatch) {
+          loop.Defer([this] { acceptAll(); });
+          return;
+        }
+        sockaddr_storage peer{};
+        socklen_t len = sizeof peer;
+        int fd = accept4(listenfd, (struct sockaddr *) &peer, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+          if (errno == EINTR || errno == ECONNABORTED) {
+            continue;
+          }
+          // EAGAIN means the backlog is drained
+          if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            acceptLater(errno);
+          }
+          return;
+        }
+        if (metrics) {
+          metrics->Accepted();
+        }
+        if (!admit(fd)) {
+          continue;
+        }
+        opts.Apply(fd);
+        // the connection and its control block in one pool slot, reused by the next connection
+        auto conn = allocate_shared<Connection>(PoolAllocator<Connection>(), fd, loop, peer, [this] (int fd) { release(fd); }, metrics);
+        Connection *c = conn.get();
+        try
+        {
+          loop.Add(fd, ConnectionEvents, [this, c] (uint32_t ev) { dispatch(*c, ev); });
+        }
+        catch (SocketError& e)
+        {
+          TCP_LOG_ERROR("Reactor accept error: " << e.what());
+          if (metrics) {
+            metrics->Error();
+          }
+          close(fd);
+          continue;
+        }
+        conns[fd] = conn;
+        setup(*c);
+        if (handlers.onConnect) {
+          invoke(handlers.onConnect, *c);
+        }
+      }
+    }
+
+    void dispatch(Connection &c, uint32_t ev)
+    {
+      if ((ev & EPOLLERR) && c.ReapErrors()) {
+        ev &= ~EPOLLERR;
+      }
+      if ((ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !c.IsClosed() && !c.ReadingPaused()) {
+        c.budget = Connection::ReadBudget;
+        if (handlers.onRead) {
+          serve(c);
+        }
+        else {
+          c.Read();
+        }
+        if (c.ended && !c.IsClosed()) {
+          c.Close();
+        }
+        else if (!c.budget && !c.IsClosed() && !c.ReadingPaused()) {
+          // the budget ran out before EAGAIN, no new edge comes for the rest
+          auto self = c.shared_from_this();
+          loop.Defer([this, self] { dispatch(*self, EPOLLIN); });
+        }
+      }
+      if ((ev & EPOLLOUT) && !c.IsClosed()) {
+        c.Flush();
+        if (!c.Pending() && !c.IsClosed() && handlers.onWrite) {
+          invoke(handlers.onWrite, c);
+        }
+      }
+      if ((ev & (EPOLLHUP | EPOLLERR)) && !c.IsClosed()) {
+        c.Close();
+      }
+    }
+
+  public:
+    Reactor(const int listenfd, const ConnectionHandlers &handlers, Metrics *metrics = nullptr)
+      : listenfd{listenfd}, handlers(handlers), metrics{metrics}
+    {
+      acceptRetry.callback = [this] { acceptAll(); };
+      loop.Add(listenfd, EPOLLIN | EPOLLET, [this] (uint32_t) { acceptAll(); });
+    }
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    virtual ~Reactor()
+    {
+      loop.Remove(listenfd);
+      for (auto &c : conns) {
+        if (c.second->zc.Retire(c.first)) {
+          IoLoop::Default().SweepRetired();
+        }
+        close(c.first);
+      }
+    }
+
+    EventLoop& Loop() { return loop; }
+    size_t Connections() const { return conns.size(); }
+
+    // applied to every connection accepted from now on
+    void SetOptions(const SocketOptions &o) { opts = o; }
+    // open connections this loop keeps, 0 for no limit
+    void SetMaxConnections(const size_t n) { maxConnections = n; }
+    void SetTimeouts(const ConnectionTimeouts &t) { timeouts = t; }
+    void SetWatermarks(const size_t high, const size_t low) { highWater = high; lowWater = low; }
+
+    virtual void Run() { loop.Run(); }
+    virtual void Stop() { loop.Stop(); }
+};
+
+}
@@ -0,0 +1,129 @@
+/*
+ * Source File: recvbuffer.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2017 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <string>
+#include "pool.h"
+
+namespace Tcp {
+
+using namespace std;
+
+/*
+ * Adaptive receive buffer kept per connection in the Pool. Drain() reads until EAGAIN, a recv that
+ * fills the buffer doubles it for the next one, so a large burst arrives in a few syscalls.
+ * After several readiness events that used less than a quarter of it the buffer halves again.
+ * Not thread safe, reads on one socket must not overlap anyway.
+ */
+class RecvBuffer
+{
+  char *buf = nullptr;
+  size_t cap, minCap, maxCap;
+  int smallReads = 0;
+
+  void free()
+  {
+    Pool::Default().Deallocate(buf, cap);
+    buf = nullptr;
+  }
+
+  void resize(const size_t n)
+  {
+    free();
+    buf = static_cast<char*>(Pool::Default().Allocate(n));
+    cap = n;
+  }
+
+  // called once per readiness event with the largest recv of that event
+  void adapt(const size_t peak)
+  {
+    if (peak * 4 > cap || cap <= minCap) {
+      smallReads = 0;
+    }
+    else if (++smallReads >= 4) {
+      resize(cap / 2 < minCap ? minCap : cap / 2);
+      smallReads = 0;
+    }
+  }
+
+  public:
+    // memory is only allocated by the first Drain()
+    explicit RecvBuffer(const size_t initial = 4096, const size_t max = 1 << 20)
+      : cap{initial ? initial : 1}, minCap{cap}, maxCap{max < cap ? cap : max} {}
+    RecvBuffer(const RecvBuffer&) = delete;
+    RecvBuffer& operator=(const RecvBuffer&) = delete;
+    ~RecvBuffer() { free(); }
+
+    size_t Capacity() const { return cap; }
+    size_t MaxCapacity() const { return maxCap; }
+
+    // start the next Drain() with at least n bytes, capped at the maximum
+    void Reserve(const size_t n)
+    {
+      if (n > cap) {
+        size_t c = n < maxCap ? n : maxCap;
+        if (buf) {
+          resize(c);
+        }
+        cap = c;
+      }
+    }
+
+    // give the memory back while the connection is idle
+    void Shrink()
+    {
+      free();
+      cap = minCap;
+      smallReads = 0;
+    }
+
+    // append everything available on the non-blocking fd to out, count(n) sees every recv result
+    // a non-zero limit stops after that many bytes as if the socket were drained, more may be queued
+    // returns 0 if the peer closed, otherwise -1 with errno, EAGAIN when the socket was drained
+    template <typename F>
+    ssize_t Drain(const int fd, string &out, F count, const size_t limit = 0)
+    {
+      if (!buf) {
+        resize(cap);
+      }
+      size_t peak = 0, got = 0;
+      ssize_t n;
+      for (;;) {
+        if (limit && got == limit) {
+          errno = EAGAIN;
+          n = -1;
+          break;
+        }
+        n = recv(fd, buf, limit && limit - got < cap ? limit - got : cap, 0);
+        count(n);
+        if (n > 0) {
+          out.append(buf, n);
+          got += n;
+          if (static_cast<size_t>(n) > peak) {
+            peak = n;
+          }
+          if (static_cast<size_t>(n) == cap && cap < maxCap) {
+            resize(cap * 2 < maxCap ? cap * 2 : maxCap);
+            smallReads = 0;
+          }
+          continue;
+        }
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      int e = errno;
+      adapt(peak);
+      errno = e;
+      return n < 0 ? -1 : 0;
+    }
+};
+
+}
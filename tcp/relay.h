@@ -0,0 +1,208 @@
+/*
+ * Source File: relay.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2017 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <chrono>
+#include <memory>
+#include "socketerror.h"
+
+namespace Tcp {
+
+using namespace std;
+
+/*
+ * One-way socket to socket forwarding. The bytes move through a pipe with splice(), so the payload
+ * never enters user space. Where splice() is refused (EINVAL, e.g. a socket type without splice
+ * support) it falls back to recv/send through a buffer of the same size.
+ * Both sockets must be non-blocking, like the ones of Server::Listen() and Client.
+ */
+class Relay
+{
+  int pipefd[2] = {-1, -1};
+  size_t capacity;
+  size_t pending = 0;     // bytes taken from in, not yet written to out
+  bool eof = false;
+  bool copying = false;
+  unique_ptr<char[]> buf; // fallback copy buffer, bytes [off, off + pending) are waiting
+  size_t off = 0;
+
+  static const unsigned Flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+
+  // splice refused, continue with the copy buffer, bytes already in the pipe move over to it
+  void fallback()
+  {
+    copying = true;
+    buf.reset(new char[capacity]);
+    off = 0;
+    size_t n = 0;
+    while (n < pending) {
+      ssize_t r = read(pipefd[0], buf.get() + n, pending - n);
+      if (r <= 0) {
+        break;
+      }
+      n += r;
+    }
+    pending = n;
+  }
+
+  // one step in either direction, false when neither could make progress
+  bool spliceStep(const int in, const int out, uint64_t &moved)
+  {
+    bool progress = false;
+    if (!eof && pending < capacity) {
+      ssize_t n = splice(in, nullptr, pipefd[1], nullptr, capacity - pending, Flags);
+      if (n > 0) {
+        pending += n;
+        progress = true;
+      }
+      else if (n == 0) {
+        eof = progress = true;
+      }
+      else if (errno == EINVAL) {
+        fallback();
+        return true;
+      }
+      else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        throw SocketError();
+      }
+    }
+    if (pending) {
+      ssize_t n = splice(pipefd[0], nullptr, out, nullptr, pending, Flags | (eof ? 0 : SPLICE_F_MORE));
+      if (n > 0) {
+        pending -= n;
+        moved += n;
+        progress = true;
+      }
+      else if (n < 0 && errno == EINVAL) {
+        fallback();
+        return true;
+      }
+      else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        throw SocketError();
+      }
+    }
+    return progress;
+  }
+
+  bool copyStep(const int in, const int out, uint64_t &moved)
+  {
+    bool progress = false;
+    if (!eof && !pending) {
+      off = 0;
+      ssize_t n = recv(in, buf.get(), capacity, 0);
+      if (n > 0) {
+        pending = n;
+        progress = true;
+      }
+      else if (n == 0) {
+        eof = progress = true;
+      }
+      else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        throw SocketError();
+      }
+    }
+    if (pending) {
+      ssize_t n = send(out, buf.get() + off, pending, MSG_NOSIGNAL);
+      if (n > 0) {
+        off += n;
+        pending -= n;
+        moved += n;
+        progress = true;
+      }
+      else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        throw SocketError();
+      }
+    }
+    return progress;
+  }
+
+  public:
+    // capacity is the pipe size asked from the kernel, the copy fallback uses a buffer of that size
+    explicit Relay(const size_t capacity = 1 << 16) : capacity{capacity}
+    {
+      if (pipe2(pipefd, O_NONBLOCK | O_CLOEXEC) < 0) {
+        fallback();
+        return;
+      }
+      int got = fcntl(pipefd[1], F_SETPIPE_SZ, static_cast<int>(capacity));
+      if (got > 0) {
+        this->capacity = got;
+      }
+      else {
+        this->capacity = fcntl(pipefd[1], F_GETPIPE_SZ);
+      }
+    }
+    Relay(const Relay&) = delete;
+    Relay& operator=(const Relay&) = delete;
+
+    virtual ~Relay()
+    {
+      if (pipefd[0] >= 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+      }
+    }
+
+    // bytes read from in and still waiting for out to become writable
+    size_t Pending() const { return pending; }
+    // in has reached end of stream
+    bool Eof() const { return eof; }
+    // in has closed and everything it sent was delivered
+    bool Done() const { return eof && !pending; }
+    bool Spliced() const { return !copying; }
+
+    // move whatever can be moved right now without blocking, returns the bytes written to out
+    // SocketError on a read or write error of either socket
+    uint64_t Pump(const int in, const int out)
+    {
+      uint64_t moved = 0;
+      for (;;) {
+        bool progress = copying ? copyStep(in, out, moved) : spliceStep(in, out, moved);
+        if (!progress || Done()) {
+          return moved;
+        }
+      }
+    }
+
+    // forward until in closes and everything was delivered, returns the bytes forwarded
+    // idle is how long to wait without progress in milliseconds, -1 waits forever (SocketError on timeout)
+    uint64_t Run(const int in, const int out, const int idle = -1)
+    {
+      uint64_t total = 0;
+      while (!Done()) {
+        total += Pump(in, out);
+        if (Done()) {
+          break;
+        }
+        pollfd p[2] = {{in, 0, 0}, {out, 0, 0}};
+        if (!eof && pending < capacity) {
+          p[0].events = POLLIN;
+        }
+        if (pending) {
+          p[1].events = POLLOUT;
+        }
+        int r = poll(p, 2, idle);
+        if (r < 0 && errno != EINTR) {
+          throw SocketError();
+        }
+        if (r == 0) {
+          throw SocketError("Relay timeout, no progress!");
+        }
+        if ((p[1].revents & (POLLERR | POLLHUP)) && pending) {
+          throw SocketError("Relay destination is closed!");
+        }
+      }
+      return total;
+    }
+};
+
+}
@@ -0,0 +1,422 @@
+/*
+ * Source File: resolver.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2017 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/poll.h>
+#include <sys/fcntl.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "logger.h"
+#include "socketerror.h"
+#include "socketoptions.h"
+
+namespace Tcp {
+
+using namespace std;
+
+/*
+ * Socket address of a peer or listener. Besides IPv4/IPv6 hosts a Unix domain stream socket is
+ * written as "unix:/path/to/socket", or "unix:@name" for the Linux abstract namespace (no file).
+ */
+struct Address
+{
+  sockaddr_storage addr{};
+  socklen_t len = 0;
+
+  int Family() const { return addr.ss_family; }
+
+  static bool IsUnix(const string &host) { return host.compare(0, 5, "unix:") == 0; }
+
+  // "unix:/path" or "unix:@name", false when host is not a Unix endpoint, SocketError if the path is too long
+  static bool Unix(const string &host, Address &a)
+  {
+    if (!IsUnix(host)) {
+      return false;
+    }
+    string path = host.substr(5);
+    sockaddr_un *un = reinterpret_cast<sockaddr_un*>(&a.addr);
+    if (path.empty() || path.size() >= sizeof un->sun_path) {
+      errno = ENAMETOOLONG;
+      throw SocketError("Invalid unix socket path");
+    }
+    a.addr = sockaddr_storage{};
+    un->sun_family = AF_UNIX;
+    memcpy(un->sun_path, path.data(), path.size());
+    if (path[0] == '@') {
+      // abstract: a leading NUL and no terminator, the length is part of the name
+      un->sun_path[0] = '\0';
+      a.len = offsetof(sockaddr_un, sun_path) + path.size();
+    }
+    else {
+      a.len = offsetof(sockaddr_un, sun_path) + path.size() + 1;
+    }
+    return true;
+  }
+
+  // numeric host without the port, the "unix:" form for a Unix domain socket
+  string Host() const
+  {
+    if (addr.ss_family == AF_UNIX) {
+      const sockaddr_un *un = reinterpret_cast<const sockaddr_un*>(&addr);
+      size_t n = len > offsetof(sockaddr_un, sun_path) ? len - offsetof(sockaddr_un, sun_path) : 0;
+      if (n && un->sun_path[0] == '\0') {
+        return "unix:@" + string(un->sun_path + 1, n - 1);
+      }
+      return "unix:" + string(un->sun_path, strnlen(un->sun_path, n));
+    }
+    char s[INET6_ADDRSTRLEN]{};
+    if (addr.ss_family == AF_INET6) {
+      inet_ntop(AF_INET6, &reinterpret_cast<const sockaddr_in6*>(&addr)->sin6_addr, s, sizeof s);
+    }
+    else {
+      inet_ntop(AF_INET, &reinterpret_cast<const sockaddr_in*>(&addr)->sin_addr, s, sizeof s);
+    }
+    return s;
+  }
+};
+
+/*
+ * Connect to the first of addrs that answers (Happy Eyeballs, RFC 8305). Attempts start delay ms apart,
+ * or at once when the previous one failed, and race each other. The winner is returned non-blocking
+ * and every other attempt is closed. timeout bounds the whole race in ms, -1 waits for the kernel.
+ */
+inline int ConnectFirst(const vector<Address> &addrs, const int timeout = 5000, const SocketOptions &opts = SocketOptions(),
+                        Address *winner = nullptr, const int delay = 250)
+{
+  if (addrs.empty()) {
+    throw SocketError("No address to connect to");
+  }
+  auto start = chrono::steady_clock::now();
+  auto deadline = start + chrono::milliseconds(timeout);
+  auto nextAt = start;
+  vector<pollfd> fds;
+  vector<size_t> which;
+  size_t next = 0;
+  int lastError = ECONNREFUSED;
+
+  auto closeAll = [&] (const int keep)
+  {
+    for (auto &p : fds) {
+      if (p.fd != keep) {
+        close(p.fd);
+      }
+    }
+  };
+
+  for (;;) {
+    auto now = chrono::steady_clock::now();
+    if (next < addrs.size() && (fds.empty() || now >= nextAt)) {
+      const Address &a = addrs[next++];
+      // a non-blocking Unix connect fails with EAGAIN on a full backlog instead of waiting,
+      // so it blocks for up to the timeout and goes non-blocking once connected
+      const bool local = a.Family() == AF_UNIX;
+      int fd = socket(a.Family(), SOCK_STREAM | SOCK_CLOEXEC | (local ? 0 : SOCK_NONBLOCK), 0);
+      if (fd < 0) {
+        lastError = errno;
+        continue;
+      }
+      opts.Prepare(fd);
+      if (local) {
+        int left = timeout < 0 ? 0 : max<int>(1, chrono::duration_cast<chrono::milliseconds>(deadline - now).count());
+        timeval tv{left / 1000, (left % 1000) * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+        int r;
+        do {
+          r = connect(fd, (const struct sockaddr *) &a.addr, a.len);
+        } while (r < 0 && errno == EINTR);
+        tv = timeval{0, 0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+        if (r < 0 || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+          lastError = errno == EAGAIN ? ETIMEDOUT : errno;
+          close(fd);
+          continue;
+        }
+      }
+      if (local || connect(fd, (const struct sockaddr *) &a.addr, a.len) == 0) {
+        closeAll(-1);
+        if (winner) {
+          *winner = a;
+        }
+        return fd;
+      }
+      if (errno != EINPROGRESS) {
+        lastError = errno;
+        close(fd);
+        continue;
+      }
+      fds.push_back(pollfd{fd, POLLOUT, 0});
+      which.push_back(next - 1);
+      nextAt = now + chrono::milliseconds(delay);
+      continue;
+    }
+    if (fds.empty()) {
+      errno = lastError;
+      throw SocketError();
+    }
+
+    // until an attempt completes, the next one is due or the deadline passes
+    int wait = -1;
+    if (next < addrs.size()) {
+      wait = max<int>(0, chrono::duration_cast<chrono::milliseconds>(nextAt - now).count());
+    }
+    if (timeout >= 0) {
+      int left = chrono::duration_cast<chrono::milliseconds>(deadline - now).count();
+      if (left <= 0) {
+        closeAll(-1);
+        errno = ETIMEDOUT;
+        throw SocketError("Connect timeout, no address answered!");
+      }
+      wait = wait < 0 ? left : min(wait, left);
+    }
+    int r = poll(fds.data(), fds.size(), wait);
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      int e = errno;
+      closeAll(-1);
+      errno = e;
+      throw SocketError();
+    }
+    for (size_t i = 0; r > 0 && i < fds.size();) {
+      if (!fds[i].revents) {
+        i++;
+        continue;
+      }
+      int err = 0;
+      socklen_t len = sizeof err;
+      getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+      if (!err) {
+        int fd = fds[i].fd;
+        if (winner) {
+          *winner = addrs[which[i]];
+        }
+        closeAll(fd);
+        return fd;
+      }
+      lastError = err;
+      close(fds[i].fd);
+      fds.erase(fds.begin() + i);
+      which.erase(which.begin() + i);
+      // a refused attempt hands over to the next address right away
+      nextAt = now;
+    }
+  }
+}
+
+/*
+ * getaddrinfo results cached per host:port for a fixed time to live, so reconnecting to the same
+ * peer skips resolution. Addresses are ordered for Happy Eyeballs, alternating between IPv6 and IPv4
+ * and starting with the family the system prefers. Expired names are dropped on insert, at most 4096
+ * are kept. Safe to use from any thread.
+ */
+class Resolver
+{
+  struct Entry
+  {
+    vector<Address> addrs;
+    chrono::steady_clock::time_point expires;
+  };
+
+  static const size_t MaxEntries = 4096;
+
+  mutable mutex m;
+  unordered_map<string, Entry> cache;
+  chrono::milliseconds ttl;
+  atomic<uint64_t> hits{0}, misses{0};
+  chrono::steady_clock::time_point nextSweep{};
+
+  static string key(const string &host, const int port) { return host + ":" + to_string(port); }
+
+  // before an insert: drop the expired entries, at most once per time to live unless the cache is full,
+  // then in a full cache the one that expires first (the oldest, the time to live is the same for all)
+  void evict(const chrono::steady_clock::time_point now)
+  {
+    if (cache.size() < MaxEntries && now < nextSweep) {
+      return;
+    }
+    nextSweep = now + ttl;
+    for (auto it = cache.begin(); it != cache.end();) {
+      it = now < it->second.expires ? next(it) : cache.erase(it);
+    }
+    if (cache.size() >= MaxEntries) {
+      auto oldest = cache.begin();
+      for (auto it = cache.begin(); it != cache.end(); ++it) {
+        if (it->second.expires < oldest->second.expires) {
+          oldest = it;
+        }
+      }
+      cache.erase(oldest);
+    }
+  }
+
+  // v6, v4, v6, ... keeping the order getaddrinfo chose within each family
+  static vector<Address> interleave(const vector<Address> &v)
+  {
+    if (v.empty()) {
+      return v;
+    }
+    vector<Address> first, second, out;
+    int preferred = v.front().Family();
+    for (auto &a : v) {
+      (a.Family() == preferred ? first : second).push_back(a);
+    }
+    for (size_t i = 0; i < first.size() || i < second.size(); i++) {
+      if (i < first.size()) {
+        out.push_back(first[i]);
+      }
+      if (i < second.size()) {
+        out.push_back(second[i]);
+      }
+    }
+    return out;
+  }
+
+  public:
+    explicit Resolver(const chrono::milliseconds ttl = chrono::seconds(30)) : ttl{ttl} {}
+    Resolver(const Resolver&) = delete;
+    Resolver& operator=(const Resolver&) = delete;
+
+    void SetTtl(const chrono::milliseconds t) { lock_guard<mutex> lk(m); ttl = t; }
+    uint64_t Hits() const { return hits.load(memory_order_relaxed); }
+    uint64_t Misses() const { return misses.load(memory_order_relaxed); }
+    size_t Size() const { lock_guard<mutex> lk(m); return cache.size(); }
+
+    // addresses of host:port when they are known without asking DNS: a "unix:" endpoint, a numeric
+    // IPv4/IPv6 host or a cached name, false otherwise
+    bool Lookup(const string &host, const int port, vector<Address> &out)
+    {
+      Address a;
+      if (Address::Unix(host, a)) {
+        out.assign(1, a);
+        return true;
+      }
+      sockaddr_in *in = reinterpret_cast<sockaddr_in*>(&a.addr);
+      sockaddr_in6 *in6 = reinterpret_cast<sockaddr_in6*>(&a.addr);
+      if (inet_pton(AF_INET, host.c_str(), &in->sin_addr) == 1) {
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        a.len = sizeof(sockaddr_in);
+        out.assign(1, a);
+        return true;
+      }
+      if (inet_pton(AF_INET6, host.c_str(), &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        a.len = sizeof(sockaddr_in6);
+        out.assign(1, a);
+        return true;
+      }
+      lock_guard<mutex> lk(m);
+      auto it = cache.find(key(host, port));
+      if (it != cache.end() && chrono::steady_clock::now() < it->second.expires) {
+        hits.fetch_add(1, memory_order_relaxed);
+        out = it->second.addrs;
+        return true;
+      }
+      return false;
+    }
+
+    // addresses of host:port, SocketError if the name does not resolve
+    // a "unix:" endpoint is returned as is, the port is ignored
+    vector<Address> Resolve(const string &host, const int port)
+    {
+      Address u;
+      if (Address::Unix(host, u)) {
+        return vector<Address>{u};
+      }
+      string k = key(host, port);
+      auto now = chrono::steady_clock::now();
+      {
+        lock_guard<mutex> lk(m);
+        auto it = cache.find(k);
+        if (it != cache.end() && now < it->second.expires) {
+          hits.fetch_add(1, memory_order_relaxed);
+          return it->second.addrs;
+        }
+      }
+      misses.fetch_add(1, memory_order_relaxed);
+
+      // resolved without the lock, a slow DNS server only holds up callers of this name
+      addrinfo hints{}, *res = nullptr;
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      int rc = getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &res);
+      if (rc != 0) {
+        TCP_LOG_ERROR("getaddrinfo: " << gai_strerror(rc));
+        errno = EHOSTUNREACH;
+        throw SocketError("Invalid address");
+      }
+      vector<Address> addrs;
+      for (addrinfo *p = res; p; p = p->ai_next) {
+        Address a;
+        memcpy(&a.addr, p->ai_addr, p->ai_addrlen);
+        a.len = p->ai_addrlen;
+        addrs.push_back(a);
+      }
+      freeaddrinfo(res);
+      addrs = interleave(addrs);
+
+      lock_guard<mutex> lk(m);
+      if (!cache.count(k)) {
+        evict(now);
+      }
+      cache[k] = Entry{addrs, now + ttl};
+      return addrs;
+    }
+
+    // drop host:port, e.g. after none of its addresses answered
+    void Forget(const string &host, const int port)
+    {
+      lock_guard<mutex> lk(m);
+      cache.erase(key(host, port));
+    }
+
+    void Clear()
+    {
+      lock_guard<mutex> lk(m);
+      cache.clear();
+    }
+
+    // resolve through the cache and race the addresses with ConnectFirst()
+    // a failed race forgets the cached addresses so the next attempt resolves again
+    int Connect(const string &host, const int port, const int timeout = 5000, const SocketOptions &opts = SocketOptions(), Address *peer = nullptr)
+    {
+      vector<Address> addrs = Resolve(host, port);
+      try
+      {
+        return ConnectFirst(addrs, timeout, opts, peer);
+      }
+      catch (SocketError&)
+      {
+        Forget(host, port);
+        throw;
+      }
+    }
+
+    // process wide resolver used by Client
+    static Resolver& Default()
+    {
+      static Resolver r;
+      return r;
+    }
+};
+
+}
@@ -0,0 +1,106 @@
+/*
+ * Source File: result.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2017 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/poll.h>
+
+namespace Tcp {
+
+using namespace std;
+
+/*
+ * Outcome of one non-throwing call (TryRead, TrySend, TryFlush, TryAccept, TryConnect).
+ * Nothing is thrown and nothing is closed behind the caller's back, the status says what happened
+ * and the caller decides whether to retry, wait or close.
+ */
+struct IoResult
+{
+  enum Status
+  {
+    Ok,         // bytes were transferred, or the operation completed
+    WouldBlock, // nothing to do right now, or data is queued for a later flush
+    Timeout,    // the wait ran out
+    Closed,     // the peer closed or reset the connection
+    Error       // hard failure, see error
+  };
+
+  Status status = Ok;
+  size_t bytes = 0;  // bytes read, or bytes accepted for sending
+  int error = 0;     // errno of Closed and Error results
+
+  IoResult() {}
+  IoResult(const Status s, const size_t bytes = 0, const int error = 0) : status{s}, bytes{bytes}, error{error} {}
+
+  // status of a failed syscall, from its errno
+  static IoResult FromErrno(const int e)
+  {
+    switch (e) {
+      case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+      case EWOULDBLOCK:
+#endif
+      case EINPROGRESS:
+        return IoResult(WouldBlock);
+      case ETIMEDOUT:
+        return IoResult(Timeout, 0, e);
+      case EPIPE:
+      case ECONNRESET:
+      case ENOTCONN:
+        return IoResult(Closed, 0, e);
+      default:
+        return IoResult(Error, 0, e);
+    }
+  }
+
+  // status of a recv/send return value, errno is only looked at when n < 0
+  static IoResult FromCall(const ssize_t n)
+  {
+    if (n > 0) {
+      return IoResult(Ok, n);
+    }
+    return n == 0 ? IoResult(Closed) : FromErrno(errno);
+  }
+
+  explicit operator bool() const { return status == Ok; }
+  // the connection is unusable, Closed or Error
+  bool Failed() const { return status == Closed || status == Error; }
+
+  const char* What() const
+  {
+    switch (status) {
+      case Ok: return "ok";
+      case WouldBlock: return "would block";
+      case Timeout: return "timeout";
+      case Closed: return error ? strerror(error) : "closed by peer";
+      default: return strerror(error);
+    }
+  }
+};
+
+// wait up to timeout ms (-1 forever, 0 just checks) for events on fd: Ok when ready, Timeout or Error
+inline IoResult PollFor(const int fd, const short events, const int timeout)
+{
+  pollfd p{fd, events, 0};
+  int r;
+  do {
+    r = poll(&p, 1, timeout);
+  } while (r < 0 && errno == EINTR);
+  if (r < 0) {
+    return IoResult(IoResult::Error, 0, errno);
+  }
+  if (r == 0) {
+    return IoResult(IoResult::Timeout);
+  }
+  if (p.revents & POLLNVAL) {
+    return IoResult(IoResult::Error, 0, EBADF);
+  }
+  return IoResult(IoResult::Ok);
+}
+
+}
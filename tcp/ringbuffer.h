@@ -0,0 +1,142 @@
+/*
+ * Source File: ringbuffer.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2017 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <vector>
+#include "pool.h"
+
+namespace Tcp {
+
+using namespace std;
+
+/*
+ * Growable power-of-two byte ring used as the outbound queue of a socket.
+ * Bytes the kernel didn't take are queued here and later written with a single sendmsg
+ * covering both halves of the ring, so many queued messages go out in one syscall.
+ */
+class RingBuffer
+{
+  vector<char, PoolAllocator<char>> buf;
+  size_t rpos = 0, wpos = 0; // free running, masked on access
+
+  size_t mask() const { return buf.size() - 1; }
+
+  void reserve(const size_t need)
+  {
+    size_t cap = buf.empty() ? 4096 : buf.size();
+    while (cap < need) {
+      cap <<= 1;
+    }
+    if (cap == buf.size()) {
+      return;
+    }
+    vector<char, PoolAllocator<char>> nb(cap);
+    iovec iov[2];
+    int cnt = Peek(iov);
+    size_t off = 0;
+    for (int i = 0; i < cnt; i++) {
+      memcpy(nb.data() + off, iov[i].iov_base, iov[i].iov_len);
+      off += iov[i].iov_len;
+    }
+    buf.swap(nb);
+    rpos = 0;
+    wpos = off;
+  }
+
+  public:
+    size_t Size() const { return wpos - rpos; }
+    bool Empty() const { return wpos == rpos; }
+    size_t Capacity() const { return buf.size(); }
+
+    void Append(const char *data, const size_t len)
+    {
+      if (!len) {
+        return;
+      }
+      reserve(Size() + len);
+      size_t start = wpos & mask();
+      size_t first = min(len, buf.size() - start);
+      memcpy(buf.data() + start, data, first);
+      memcpy(buf.data(), data + first, len - first);
+      wpos += len;
+    }
+
+    // readable regions, at most two when the data wraps around
+    int Peek(iovec iov[2]) const
+    {
+      if (Empty()) {
+        return 0;
+      }
+      size_t start = rpos & mask();
+      size_t first = min(Size(), buf.size() - start);
+      iov[0].iov_base = const_cast<char*>(buf.data()) + start;
+      iov[0].iov_len = first;
+      if (first == Size()) {
+        return 1;
+      }
+      iov[1].iov_base = const_cast<char*>(buf.data());
+      iov[1].iov_len = Size() - first;
+      return 2;
+    }
+
+    void Consume(const size_t n)
+    {
+      rpos += min(n, Size());
+      if (Empty()) {
+        rpos = wpos = 0;
+      }
+    }
+
+    void Clear() { rpos = wpos = 0; }
+
+    /*
+     * Write the queued bytes followed by data in one sendmsg and queue whatever the socket didn't take.
+     * Returns bytes written to the socket (0 when it would block) or -1 on a hard error.
+     */
+    ssize_t WriteTo(const int fd, const char *data = nullptr, const size_t len = 0)
+    {
+      iovec iov[3];
+      int cnt = Peek(iov);
+      if (len) {
+        iov[cnt].iov_base = const_cast<char*>(data);
+        iov[cnt].iov_len = len;
+        cnt++;
+      }
+      if (!cnt) {
+        return 0;
+      }
+      msghdr m{};
+      m.msg_iov = iov;
+      m.msg_iovlen = cnt;
+      ssize_t n;
+      do {
+        n = sendmsg(fd, &m, MSG_NOSIGNAL);
+      } while (n < 0 && errno == EINTR);
+      if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          return -1;
+        }
+        n = 0;
+      }
+      size_t queued = Size();
+      if (static_cast<size_t>(n) >= queued) {
+        Consume(queued);
+        size_t sent = n - queued;
+        Append(data + sent, len - sent);
+      }
+      else {
+        Consume(n);
+        Append(data, len);
+      }
+      return n;
+    }
+};
+
+}
@@ -13,10 +13,31 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/fcntl.h>
+#include <sys/stat.h>
 #include <thread>
+#include <chrono>
 #include <future>
 #include <sstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <pthread.h>
 #include "socketerror.h"
+#include "buffer.h"
+#include "ringbuffer.h"
+#include "recvbuffer.h"
+#include "codec.h"
+#include "executor.h"
+#include "asyncio.h"
+#include "logger.h"
+#include "metrics.h"
+#include "socketoptions.h"
+#include "resolver.h"
+#include "result.h"
+#include "backpressure.h"
+#include "zerocopy.h"
+#include "reactor.h"
+#include "uring.h"
 
 namespace Tcp {
 
@@ -24,52 +45,265 @@ using namespace std;
 
 class Server
 {
-  int sockfd, newsockfd, PORT, rv;
+  // reset by Close(), so a second Close() never closes a reused fd number
+  mutable int sockfd = -1, newsockfd = -1;
+  int PORT, rv;
   string IP;
   socklen_t clen;
-  sockaddr_in server_addr{}, client_addr{};
+  sockaddr_storage client_addr{};
+  Address local; // listening address, IPv4 or a "unix:" endpoint
   int listenF = false;
   int ServerLoop = false;
   struct pollfd rs[2];
+  ConnectionHandlers handlers;
+  vector<unique_ptr<Reactor>> reactors;
+  vector<int> workerfds;
+  // Stop() may come from any thread while Serve() sets the loops up, it finds them complete or not at all
+  mutex reactorsLock;
+  bool serving = false, stopping = false;
+  mutable RingBuffer outbuf;
+  RecvBuffer inbuf;
+  int sendTimeout = 5000;
+  int pollTimeout = 10; // how long Read/ReadAsync wait for data, see SetPollTimeout()
+  int backend = 0; // Backend, see SetBackend()
+  size_t maxConnections = 0; // per Serve() worker, see SetMaxConnections()
+  ConnectionTimeouts timeouts;
+  size_t highWater = 0, lowWater = 0; // per Serve() connection, see SetWatermarks()
+  mutable Metrics metrics;
+  SocketOptions opts;
+  // when the request being answered was read, steady clock ticks, 0 if none is pending
+  mutable atomic<int64_t> requestAt{0};
+  // bytes handed to SendFuture()/SendAsync() and not written yet, see SetSendWatermarks()
+  mutable Backpressure pressure;
+  // MSG_ZEROCOPY for large SendFuture()/SendAsync() payloads, see EnableZeroCopy()
+  size_t zeroCopyMin = 0;
+  mutable ZeroCopy zc;
+  // futures driven by the I/O loop, declared last so it detaches before the members it uses are destroyed
+  mutable AsyncIo aio{outbuf, inbuf, zc, [this] (const ssize_t n) { return sent(n); }, [this] (string &s) { return drain(s); }};
  
-  int initSocket(const int &port, const string ip = "127.0.0.1")
+  // data starts the service time of the response that follows
+  void requested() const
   {
-    PORT = port;
-    IP = ip;
-    try
-    {
-	  if (port <= 0){
-	    throw SocketError("Invalid port");
+    opts.Rearm(newsockfd);
+    requestAt.store(chrono::steady_clock::now().time_since_epoch().count(), memory_order_relaxed);
+  }
+
+  // count one recv
+  void received(const ssize_t n) const
+  {
+    metrics.Received(n);
+    if (n > 0) {
+      requested();
+    }
+  }
+
+  // count one send, the service time ends once the response has been fully written
+  ssize_t sent(const ssize_t n) const
+  {
+    metrics.Sent(n, outbuf.Size());
+    if (n >= 0 && outbuf.Empty()) {
+      int64_t at = requestAt.exchange(0, memory_order_relaxed);
+      if (at) {
+        metrics.Service(chrono::steady_clock::time_point(chrono::steady_clock::duration(at)));
+      }
+    }
+    return n;
+  }
+
+  // receive everything queued on the connection into out, see RecvBuffer::Drain()
+  // at most one full buffer per call, a fast sender cannot grow out without bound, the rest waits for the next read
+  ssize_t drain(string &out)
+  {
+    size_t before = out.size();
+    ssize_t r = inbuf.Drain(newsockfd, out, [this] (const ssize_t n) { metrics.Received(n); }, inbuf.MaxCapacity());
+    if (out.size() > before) {
+      requested();
+    }
+    return r;
+  }
+
+  // write through the outbound queue, a short write or EAGAIN queues the rest and waits for
+  // writability instead of failing, so large responses reach the wire intact
+  ssize_t sendAll(const char *data, const size_t len) const
+  {
+    IoResult r = TrySend(data, len, sendTimeout);
+    if (r.Failed()) {
+      errno = r.error;
+      throw SocketError();
+    }
+    if (!r) {
+      throw SocketError("Server send timeout, peer is not reading!");
+    }
+    return len;
+  }
+
+  // an asynchronous send that did not complete, as the SocketError a blocking Send() throws
+  SocketError sendError(const IoResult &r) const
+  {
+    if (r.status == IoResult::Timeout) {
+      return SocketError("Server send timeout, peer is not reading!");
+    }
+    errno = r.error;
+    return SocketError();
+  }
+
+  // poll for data unless timeout is 0, a wait that ran out is counted as a poll timeout
+  IoResult readable(const int timeout) const
+  {
+    if (!timeout) {
+      return IoResult(IoResult::Ok);
+    }
+    IoResult r = PollFor(newsockfd, POLLIN, timeout);
+    if (r.status == IoResult::Timeout) {
+      metrics.PollTimeout();
+    }
+    return r;
+  }
+
+  // io_uring when it was requested and the kernel supports it, epoll otherwise
+  unique_ptr<Reactor> makeReactor(const int fd)
+  {
+    unique_ptr<Reactor> r;
+#ifdef TCP_HAVE_IO_URING
+    if (backend == IoUring) {
+      try
+      {
+        r.reset(new UringReactor(fd, handlers, &metrics));
+      }
+      catch (SocketError& e)
+      {
+        TCP_LOG_WARN("io_uring unavailable, using epoll: " << e.what());
+        backend = Epoll;
+      }
+    }
+#endif
+    if (!r) {
+      r.reset(new Reactor(fd, handlers, &metrics));
+    }
+    r->SetOptions(opts);
+    r->SetMaxConnections(maxConnections);
+    r->SetTimeouts(timeouts);
+    r->SetWatermarks(highWater, lowWater);
+    return r;
+  }
+
+  // host:port for the log, the endpoint alone for a Unix domain socket
+  string endpoint() const { return local.Family() == AF_UNIX ? IP : IP + ":" + to_string(PORT); }
+
+  // the socket file of a Unix listener, null for the abstract namespace, TCP or when there is none
+  const char* socketPath() const
+  {
+    const sockaddr_un *un = reinterpret_cast<const sockaddr_un*>(&local.addr);
+    struct stat st;
+    if (local.Family() == AF_UNIX && un->sun_path[0] && stat(un->sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+      return un->sun_path;
+    }
+    return nullptr;
+  }
+
+  // a Unix socket file left behind by an earlier run would make bind() fail, anything else is kept
+  // a server still accepting on the path keeps it as well, bind() then fails with EADDRINUSE
+  void unlinkStale() const
+  {
+    const char *path = socketPath();
+    if (!path) {
+      return;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      throw SocketError();
+    }
+    // refused means nobody listens, EAGAIN is a live server with a full backlog
+    int r = connect(fd, (const struct sockaddr *) &local.addr, local.len);
+    int e = errno;
+    close(fd);
+    if (r < 0 && e == ECONNREFUSED) {
+      unlink(path);
+    }
+    else if (r == 0 || e == EAGAIN) {
+      errno = EADDRINUSE;
+      throw SocketError();
+    }
+  }
+
+  // reusePort lets every Serve() worker bind its own listener on the same port, only set for more than
+  // one worker since any process of the same user could then bind the port and take part of the connections
+  int bindListener(const bool reusePort = false)
+  {
+	  if (!Address::Unix(IP, local)) {
+	    sockaddr_in *in = reinterpret_cast<sockaddr_in*>(&local.addr);
+	    in->sin_family = AF_INET;
+	    in->sin_port = htons(PORT);
+	    inet_pton(AF_INET, IP.c_str(), &in->sin_addr);
+	    local.len = sizeof(sockaddr_in);
+	  }
+	  if (local.Family() == AF_UNIX) {
+	    unlinkStale();
 	  }
-	  sockfd =  socket(AF_INET, SOCK_STREAM, 0);
-	  if (sockfd < 0) {
+	  int fd = socket(local.Family(), SOCK_STREAM | SOCK_CLOEXEC, 0);
+	  if (fd < 0) {
 	    throw SocketError();
 	  }
-	  server_addr.sin_family = AF_INET;
-	  server_addr.sin_port = htons(port);
-	  inet_pton(AF_INET, ip.c_str(), &server_addr.sin_addr);
 
-	  int reuse = 1; //reuse socket
-	  setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int));
-	  if ( bind(sockfd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0)
+	  if (local.Family() != AF_UNIX) {
+	    int reuse = 1; //reuse socket
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int));
+	    if (reusePort) {
+	      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(int));
+	    }
+	  }
+	  opts.PrepareListener(fd);
+	  if ( bind(fd, (struct sockaddr *) &local.addr, local.len) < 0 || listen(fd, opts.backlog) < 0)
 	  {
+	    int e = errno;
+	    close(fd);
+	    errno = e;
 	    throw SocketError();
 	  }
-	  else
-	  {
-	    listen(sockfd, 5);
-	    clen = sizeof(client_addr);
+	  return fd;
+  }
+
+  int initSocket(const int &port, const string ip = "127.0.0.1")
+  {
+    PORT = port;
+    IP = ip;
+    try
+    {
+	  if (port <= 0 && !Address::IsUnix(ip)){
+	    throw SocketError("Invalid port");
 	  }
+	  sockfd = bindListener();
+	  clen = sizeof(client_addr);
 	  return 0;
     }
     catch (SocketError& e)
     {
-	  cerr << "Server Socket Initialize Error: " << e.what() << endl;
+	  TCP_LOG_ERROR("Server Socket Initialize Error: " << e.what());
 	  closeHandler();
 	  exit(1);
     }
   }
 
+  // make an accepted socket the current connection
+  void adopt(const int fd)
+  {
+    aio.Detach();
+    // a no-op after Close(), otherwise the previous connection stays open and keeps its buffers
+    if (zc.Retire(newsockfd)) {
+      IoLoop::Default().SweepRetired();
+    }
+    newsockfd = fd;
+    opts.Apply(newsockfd);
+    outbuf.Clear();
+    inbuf.Shrink();
+    if (zeroCopyMin) {
+      zc.Enable(newsockfd, zeroCopyMin);
+    }
+    metrics.Accepted();
+    rs[0].fd = newsockfd;
+    rs[0].events = POLLIN | POLLPRI;
+  }
+
   void closeHandler() const
   {
     Close();
@@ -78,14 +312,19 @@ class Server
   }
 
   public:
+    enum Backend { Epoll, IoUring };
+
     // use with createServer() method
     Server(){}
     // immediately initialize the server socket with the port provided
-    Server(const int &port, const string ip = "127.0.0.1" ): PORT{port}, IP{ip} { initSocket(port, ip); }
+    // socket options are applied to the listener (buffer sizes) and to every accepted socket
+    // ip "unix:/path" or "unix:@name" listens on a Unix domain socket instead, the port is ignored then
+    Server(const int &port, const string ip = "127.0.0.1", const SocketOptions &o = SocketOptions()): PORT{port}, IP{ip}, opts(o) { initSocket(port, ip); }
     virtual ~Server() {}
 
-    void createServer(const int &port, const string ip = "127.0.0.1")
+    void createServer(const int &port, const string ip = "127.0.0.1", const SocketOptions &o = SocketOptions())
     {
+        opts = o;
         initSocket(port, ip);
     }
 
@@ -94,77 +333,145 @@ class Server
       ServerLoop = serverloop;
       try
       {
-        auto l = [] (int fd, sockaddr_in client_addr, socklen_t clen)
-        {
-          auto newfd = accept4(fd, (struct sockaddr *) &client_addr, &clen, SOCK_NONBLOCK);
-          if (newfd < 0){ throw SocketError("Invalid socket descriptor! Listen flag is false! \nMaybe you want to set it to true like Listen(true).");}
-          return newfd;
-        };
-
-
         if (!listenF){
           // initial server console output, provide one in the your application
-          std::cout << "Server listening on: " << IP << ":" << PORT << "\n\n";
+          TCP_LOG_INFO("Server listening on: " << endpoint());
           listenF = true;
         }
 
-        auto nfd = std::async(l, sockfd, client_addr, clen);
-        newsockfd = nfd.get();
+        // accepted on the calling thread, the listener may be non-blocking after Serve()
+        int fd;
+        for (;;) {
+          clen = sizeof(client_addr);
+          fd = accept4(sockfd, (struct sockaddr *) &client_addr, &clen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+          if (fd >= 0) {
+            break;
+          }
+          if (errno == EINTR || errno == ECONNABORTED) {
+            continue;
+          }
+          if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            throw SocketError("Invalid socket descriptor! Listen flag is false! \nMaybe you want to set it to true like Listen(true).");
+          }
+          IoResult r = PollFor(sockfd, POLLIN, -1);
+          if (!r) {
+            errno = r.error;
+            throw SocketError();
+          }
+        }
+        adopt(fd);
 
         //s td::cout << "server connection from client " << inet_ntoa(client_addr.sin_addr) << ":" << ntohs(client_addr.sin_port) << "\n\n"; 
-        rs[0].fd = newsockfd;
-        rs[0].events = POLLIN | POLLPRI;
 
       }
       catch (SocketError& e)
       {
-        std::cerr << "Server Listen Error: " << e.what() << std::endl;
+        TCP_LOG_ERROR("Server Listen Error: " << e.what());
         closeHandler();
       }
     }
 
+    // everything received so far, the receive buffer grows with the burst instead of cutting it at a fixed size
     virtual const string Read()
     {
-      char buffer[1024];
+      string data;
       try
       {
         if(!listenF){
           throw SocketError("No listening socket!\n Did you forget to start the Listen() method!");
         }
+        AsyncIo::Blocking turn(aio, AsyncIo::Reading);
 
-        // check socket event for available data, wait 100 milliseconds for timeout
-        rv = poll(rs, 1, 10); // adjust timeout based on requirements
+        // check socket event for available data, wait pollTimeout milliseconds
+        rv = poll(rs, 1, pollTimeout);
         if (rv < 0) {
           throw SocketError();
         } else if (rv == 0) {
-          cout << "Server read timeout error! No data received!\n";
+          metrics.PollTimeout();
+          TCP_LOG_INFO("Server read timeout error! No data received!");
         } else {
           ssize_t n{1};
-          bzero(buffer, sizeof(buffer));
 
           // check for events on newsockfd:
           if (rs[0].revents & POLLIN) {
             rs[0].revents = 0;
-            n = {recv(newsockfd, buffer, sizeof(buffer), 0)}; // receive normal data
+            n = drain(data); // receive normal data
           }
           if (rs[0].revents & POLLPRI) {
             rs[0].revents = 0;
-            n = {recv(newsockfd, buffer, sizeof(buffer), MSG_OOB)}; // out-of-band data
+            char oob;
+            n = {recv(newsockfd, &oob, 1, MSG_OOB)}; // out-of-band data
+            received(n);
+            if (n > 0) {
+              data += oob;
+            }
           }
-          if (n == 0){
-            cout << "Server read error, socket is closed or disconnected!\n";
+          if (n == 0 && data.empty()){
+            TCP_LOG_INFO("Server read error, socket is closed or disconnected!");
           }
         }
       }
       catch (SocketError& e)
       {
-        cerr << "Server Read Error: " << e.what() << endl;
+        TCP_LOG_ERROR("Server Read Error: " << e.what());
         closeHandler();
       }
-      return buffer;
+      return data;
+    }
+
+    // binary-safe read straight into a caller owned buffer, nothing is allocated or copied
+    // returns bytes received, 0 if the peer closed, -1 on read timeout (errno EAGAIN)
+    virtual ssize_t Read(char *buf, const size_t len)
+    {
+      try
+      {
+        if(!listenF){
+          throw SocketError("No listening socket!\n Did you forget to start the Listen() method!");
+        }
+        AsyncIo::Blocking turn(aio, AsyncIo::Reading);
+
+        rv = poll(rs, 1, pollTimeout);
+        if (rv < 0) {
+          throw SocketError();
+        } else if (rv == 0) {
+          metrics.PollTimeout();
+          errno = EAGAIN;
+          return -1;
+        }
+        // out-of-band data only when nothing else is readable, a hang-up or error takes the plain recv
+        // so it returns 0 or the real errno
+        int flags = !(rs[0].revents & POLLIN) && (rs[0].revents & POLLPRI) ? MSG_OOB : 0;
+        rs[0].revents = 0;
+        ssize_t n{recv(newsockfd, buf, len, flags)};
+        received(n);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+          throw SocketError();
+        }
+        return n;
+      }
+      catch (SocketError& e)
+      {
+        TCP_LOG_ERROR("Server Read Error: " << e.what());
+        closeHandler();
+      }
+      return -1;
+    }
+
+    ssize_t Read(MutableBuffer buf) { return Read(buf.data, buf.size); }
+
+    // framed read: wait for data like Read(), receive it into the codec and append every complete
+    // message to msgs, returns the number of messages decoded (SocketError on a malformed frame)
+    size_t ReadMessages(Codec &codec, vector<string> &msgs, const size_t chunk = 16384)
+    {
+      ssize_t n = Read(codec.Prepare(chunk), chunk);
+      if (n > 0) {
+        codec.Commit(n);
+      }
+      return codec.Decode(msgs);
     }
 
     // read data asynchronously, use only after calling Listen() method
+    // bufsize sizes the first recv, the buffer grows from there until the socket is drained
     virtual const string ReadAsync(const int bufsize=1024) 
     //virtual const string ReadAsync()
     {
@@ -173,53 +480,50 @@ class Server
       try
       {
         // lamda function
-        auto l = [] (const int newsockfd, const int &bufsize=1024)
+        auto l = [this] (const int bufsize)
         {
           // cout << "server read async using lamda function" << endl; 
           string s;
-          char buffer[bufsize];
-          bzero(buffer, sizeof(buffer));
-          ssize_t n {recv(newsockfd, buffer, sizeof(buffer), 0)};
+          inbuf.Reserve(bufsize > 0 ? bufsize : 1);
+          ssize_t n {drain(s)};
 
-          // cout << "server read async n bytes = " << n << endl; 
-          if (n < 0) {
-            cout << "Server read async error: No data available" << endl;
+          TCP_LOG_DEBUG("server read async n bytes = " << s.size());
+          if (n < 0 && s.empty()) {
+            TCP_LOG_INFO("Server read async error: No data available");
           }
-          if (n == 0){
-            cout << "Server read async error, socket at the other end is closed or disconnected!\n";
+          if (n == 0 && s.empty()){
+            TCP_LOG_INFO("Server read async error, socket at the other end is closed or disconnected!");
           }
-          s = &buffer[0];
-          // cout << "return buffer" << endl;
           return s; 
         };
 
         if(!listenF){
           throw SocketError("No listening socket!\n Did you forget to start the Listen() method!");
         }
+        AsyncIo::Blocking turn(aio, AsyncIo::Reading);
 
-        // check socket event for available data, wait 10 milliseconds for timeout
-        rv = poll(rs, 1, 10); // adjust not higher than 10 ms for optimum wait time
+        // check socket event for available data, wait pollTimeout milliseconds
+        rv = poll(rs, 1, pollTimeout);
         if (rv < 0) {
           throw SocketError();
         } else if (rv == 0) {
-            cout << "Server read async timeout error! No data received!\n";
+            metrics.PollTimeout();
+            TCP_LOG_INFO("Server read async timeout error! No data received!");
         } else {
           ssize_t n{1};
           if (rs[0].revents & POLLIN) {
-          rs[0].revents = 0;
-	  // return future data(fd) using inline lamda function
-          auto rf = async(l, newsockfd, bufsize);
-	  // async data 
-          ad = rf.get();
+            rs[0].revents = 0;
+            // async data
+            ad = l(bufsize);
           }
           if (n == 0){
-            cout << "Server read async error, socket is closed or disconnected!\n";
+            TCP_LOG_INFO("Server read async error, socket is closed or disconnected!");
           }
         }
       }
       catch (SocketError& e)
       {
-        cerr << "Server Send Async Error: " << e.what() << endl;
+        TCP_LOG_ERROR("Server Send Async Error: " << e.what());
         closeHandler();
       }
       return ad;
@@ -233,54 +537,445 @@ class Server
             throw SocketError("No listening socket!\n Did you forget to start the Listen() method!");
           }
 
-          ssize_t n{send(newsockfd, msg.c_str(), strlen(msg.c_str()), 0)};
-          if (n < 0) {
-            throw SocketError();
-          }
+          sendAll(msg.data(), msg.size());
         }
         catch (SocketError& e)
         {
-          cerr << "Server Send Error: " << e.what() << endl;
+          TCP_LOG_ERROR("Server Send Error: " << e.what());
           closeHandler();
         }
         return msg;
     }
 
-    // send data synchronously, use only after calling Listen() method
+    // binary-safe send from a caller owned buffer, returns bytes sent
+    virtual ssize_t Send(const char *data, const size_t len) const
+    {
+        try
+        {
+          if(!listenF){
+            throw SocketError("No listening socket!\n Did you forget to start the Listen() method!");
+          }
+
+          return sendAll(data, len);
+        }
+        catch (SocketError& e)
+        {
+          TCP_LOG_ERROR("Server Send Error: " << e.what());
+          closeHandler();
+        }
+        return -1;
+    }
+
+    ssize_t Send(ConstBuffer buf) const { return Send(buf.data, buf.size); }
+
+    // send data synchronously through the I/O loop, use only after calling Listen() method
     virtual const string SendAsync(const string &msg) const
     {
       try
       {
-        // using lambda expressions
-        auto l = [] (const int newsockfd, const string &msg)
-        {
-    	// cout << "server send async using lambda function." << endl; 
-    	ssize_t n{send(newsockfd, msg.c_str(), strlen(msg.c_str()), 0)};
-    	if (n < 0) {
-      		throw SocketError();
-    	}
-        return msg;
-        };
-        auto sf = std::async(l, newsockfd, msg); 
-        auto d = sf.get();
-          return d;
+        SendFuture(msg).get();
       }
       catch (SocketError& e)
       {
-        cerr << "Server Async Send Error: " << e.what() << endl;
+        TCP_LOG_ERROR("Server Async Send Error: " << e.what());
         closeHandler();
       }
       return msg;
     }
 
+    // asynchronous send on the shared I/O loop, no thread waits while the peer is slow
+    // sends on this server are written in call order, after a blocking Send() that is in progress
+    // the future resolves with the bytes sent or rethrows the SocketError
+    // above the send watermark the caller waits for earlier sends to drain, SocketError after the send timeout
+    future<ssize_t> SendFuture(string msg) const
+    {
+      const size_t len = msg.size();
+      if (!pressure.Acquire(len, sendTimeout)) {
+        throw SocketError("Server send queue is full, peer is not reading!");
+      }
+      auto p = make_shared<promise<ssize_t>>();
+      future<ssize_t> f = p->get_future();
+      aio.Send(newsockfd, make_shared<const string>(move(msg)), sendTimeout, [this, p, len] (const IoResult r)
+      {
+        pressure.Release(len);
+        if (r) {
+          p->set_value(len);
+        }
+        else {
+          p->set_exception(make_exception_ptr(sendError(r)));
+        }
+      });
+      return f;
+    }
+
+    // same with a completion callback, run on an executor thread with the bytes sent or -1 on error
+    // (on the calling thread when the send queue stayed full for the send timeout)
+    void SendAsync(string msg, function<void(ssize_t)> done) const
+    {
+      const size_t len = msg.size();
+      if (!pressure.Acquire(len, sendTimeout)) {
+        if (done) { done(-1); }
+        return;
+      }
+      aio.Send(newsockfd, make_shared<const string>(move(msg)), sendTimeout, [this, len, done] (const IoResult r)
+      {
+        pressure.Release(len);
+        if (done) {
+          const ssize_t n = r ? static_cast<ssize_t>(len) : -1;
+          Executor::Default().Post([done, n] { done(n); });
+        }
+      });
+    }
+
+    // limit the bytes SendFuture()/SendAsync() may have waiting: at high the caller blocks until
+    // the queue drained to low, 0 turns it off (the default)
+    void SetSendWatermarks(const size_t high, const size_t low) { pressure.Set(high, low); }
+
+    // send SendFuture()/SendAsync() payloads of at least threshold bytes with MSG_ZEROCOPY, from the
+    // string itself; worth it for large payloads on a real NIC, over loopback the kernel copies anyway
+    // and the connection falls back to regular sends. 0 turns it off for the next connection
+    void EnableZeroCopy(const size_t threshold = 32768)
+    {
+      zeroCopyMin = threshold;
+      // the asynchronous sends use zc on the I/O loop
+      AsyncIo::Blocking turn(aio, AsyncIo::Sending);
+      if (threshold && newsockfd >= 0) {
+        zc.Enable(newsockfd, threshold);
+      }
+    }
+
+    // bytes handed to SendFuture()/SendAsync() and not written yet
+    size_t Queued() const { return pressure.Queued(); }
+
+    // asynchronous read on the shared I/O loop, waits up to timeout milliseconds (-1 forever) for data
+    // the future resolves with the data received, empty on timeout or if the peer closed
+    future<string> ReadFuture(const size_t bufsize = 1024, const int timeout = 1000)
+    {
+      auto p = make_shared<promise<string>>();
+      future<string> f = p->get_future();
+      aio.Read(newsockfd, bufsize, timeout, [this, p] (const IoResult r, string s)
+      {
+        if (r.status == IoResult::Error) {
+          errno = r.error;
+          p->set_exception(make_exception_ptr(SocketError()));
+          return;
+        }
+        if (r.status == IoResult::Timeout) {
+          metrics.PollTimeout();
+        }
+        p->set_value(move(s));
+      });
+      return f;
+    }
+
+    // same with a completion callback, run on an executor thread
+    void ReadAsync(function<void(string)> done, const size_t bufsize = 1024, const int timeout = 1000)
+    {
+      aio.Read(newsockfd, bufsize, timeout, [this, done] (const IoResult r, string s)
+      {
+        if (r.status == IoResult::Timeout) {
+          metrics.PollTimeout();
+        }
+        if (done) {
+          Executor::Default().Post(bind(done, move(s)));
+        }
+      });
+    }
+
+    // wait up to timeout milliseconds (-1 blocks) for queued bytes to be written, returns bytes still queued
+    size_t Flush(const int timeout = -1) const
+    {
+      AsyncIo::Blocking turn(aio, AsyncIo::Sending);
+      IoResult r = TryFlush(timeout);
+      if (r.Failed()) {
+        errno = r.error;
+        throw SocketError();
+      }
+      return outbuf.Size();
+    }
+
+    /*
+     * Non-throwing API: errors, timeouts and EAGAIN come back as an IoResult status instead of a
+     * SocketError and the connection is left open for the caller to decide.
+     * timeout is in milliseconds, -1 waits forever and 0 never waits.
+     */
+
+    // like Listen(), wait for the next client and make it the current connection
+    // serverloop decides what Close() ends as for Listen(): false closes the listener too, true keeps it
+    // for the next accept; it is only changed when a client was accepted
+    // Ok once accepted, WouldBlock or Timeout if nobody connected, Error otherwise
+    IoResult TryAccept(const int timeout = -1, const bool serverloop = false)
+    {
+      IoResult r = PollFor(sockfd, POLLIN, timeout);
+      if (r.status == IoResult::Timeout && !timeout) {
+        return IoResult(IoResult::WouldBlock);
+      }
+      if (!r) {
+        return r;
+      }
+      clen = sizeof(client_addr);
+      int fd = accept4(sockfd, (struct sockaddr *) &client_addr, &clen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        return IoResult::FromErrno(errno);
+      }
+      ServerLoop = serverloop;
+      listenF = true;
+      adopt(fd);
+      return IoResult(IoResult::Ok);
+    }
+
+    // like Flush(), Ok once nothing is queued, WouldBlock or Timeout while bytes are still queued
+    IoResult TryFlush(const int timeout = -1) const
+    {
+      AsyncIo::Blocking turn(aio, AsyncIo::Sending);
+      auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout);
+      size_t written = 0;
+      while (!outbuf.Empty()) {
+        int wait = -1;
+        if (timeout >= 0) {
+          auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+          wait = left > 0 ? static_cast<int>(left) : 0;
+        }
+        IoResult p = PollFor(newsockfd, POLLOUT, wait);
+        if (p.status == IoResult::Timeout) {
+          return IoResult(timeout ? IoResult::Timeout : IoResult::WouldBlock, written);
+        }
+        if (p.Failed()) {
+          return p;
+        }
+        ssize_t n = sent(outbuf.WriteTo(newsockfd));
+        if (n < 0) {
+          return IoResult::FromErrno(errno);
+        }
+        if (!n && zc.Used()) {
+          // woken by zero-copy completions, not by room in the send buffer
+          zc.Reap(newsockfd);
+        }
+        written += n;
+      }
+      return IoResult(IoResult::Ok, written);
+    }
+
+    // send or queue all of data, then wait up to timeout for the queue to drain
+    // bytes is len unless the send failed, WouldBlock or Timeout mean part of it is still queued
+    IoResult TrySend(const char *data, const size_t len, const int timeout = 0) const
+    {
+      AsyncIo::Blocking turn(aio, AsyncIo::Sending);
+      if (sent(outbuf.WriteTo(newsockfd, data, len)) < 0) {
+        return IoResult::FromErrno(errno);
+      }
+      IoResult r = outbuf.Empty() ? IoResult(IoResult::Ok) : TryFlush(timeout);
+      if (!r.Failed()) {
+        r.bytes = len;
+      }
+      return r;
+    }
+
+    IoResult TrySend(ConstBuffer buf, const int timeout = 0) const { return TrySend(buf.data, buf.size, timeout); }
+
+    // append everything available to out, Ok with the bytes read, WouldBlock or Timeout without data,
+    // Closed once the peer has closed
+    IoResult TryRead(string &out, const int timeout = 0)
+    {
+      AsyncIo::Blocking turn(aio, AsyncIo::Reading);
+      IoResult r = readable(timeout);
+      if (!r) {
+        return r;
+      }
+      size_t before = out.size();
+      ssize_t n = drain(out);
+      if (out.size() > before) {
+        return IoResult(IoResult::Ok, out.size() - before);
+      }
+      return n == 0 ? IoResult(IoResult::Closed) : IoResult::FromErrno(errno);
+    }
+
+    // one recv into a caller owned buffer
+    IoResult TryRead(char *buf, const size_t len, const int timeout = 0)
+    {
+      AsyncIo::Blocking turn(aio, AsyncIo::Reading);
+      IoResult r = readable(timeout);
+      if (!r) {
+        return r;
+      }
+      ssize_t n;
+      do {
+        n = recv(newsockfd, buf, len, 0);
+      } while (n < 0 && errno == EINTR);
+      received(n);
+      return IoResult::FromCall(n);
+    }
+
+    IoResult TryRead(MutableBuffer buf, const int timeout = 0) { return TryRead(buf.data, buf.size, timeout); }
+
+    // socket of the connection accepted by Listen(), e.g. for a Relay
+    int Fd() const { return newsockfd; }
+
+    // Cork(true) holds partial segments while a response is built from several Sends, Cork(false) pushes them out
+    void Cork(const bool on) const { SocketOptions::Cork(newsockfd, on); }
+
+    // how long Send/SendAsync wait for a slow peer to take queued bytes, -1 waits forever
+    void SetSendTimeout(const int ms) { sendTimeout = ms; }
+    // how long Read() and ReadAsync() wait for data before reporting a read timeout, 10 ms by default, -1 blocks
+    void SetPollTimeout(const int ms) { pollTimeout = ms; }
+
+    // counters and histograms of this server and its Serve() connections, see Metrics::Snap() and Export()
+    Metrics& Stats() const { return metrics; }
+
+    // event loop backend for Serve(), IoUring falls back to Epoll when the build or kernel lacks it
+    void SetBackend(const Backend b) { backend = b; }
+
+    // admission control for Serve(), each worker closes new connections beyond n open ones, 0 for no limit
+    // rejected connections are counted in Stats() as rejects
+    void SetMaxConnections(const size_t n) { maxConnections = n; }
+
+    // deadlines in ms for every Serve() connection, 0 is off: close after idle ms without traffic,
+    // after read ms without incoming data, or when queued output makes no progress for write ms
+    // a connection can change its own with Connection::SetIdleTimeout() and friends, e.g. in onConnect
+    void SetConnectionTimeouts(const uint64_t idle, const uint64_t read = 0, const uint64_t write = 0)
+    {
+      timeouts.idle = idle;
+      timeouts.read = read;
+      timeouts.write = write;
+    }
+
+    // callbacks for the multi-connection mode started with Serve()
+    void OnConnect(ConnectionHandler h) { handlers.onConnect = move(h); }
+    void OnRead(ConnectionHandler h) { handlers.onRead = move(h); }
+    void OnWrite(ConnectionHandler h) { handlers.onWrite = move(h); }
+    void OnClose(ConnectionHandler h) { handlers.onClose = move(h); }
+
+    // outbound queue limits of every Serve() connection in bytes, 0 is off (see Connection::SetWatermarks())
+    // OnHighWater runs once a connection has high bytes queued, OnLowWater once it drained to low;
+    // without them the connection stops reading at high and resumes at low
+    void SetWatermarks(const size_t high, const size_t low) { highWater = high; lowWater = low; }
+    void OnHighWater(ConnectionHandler h) { handlers.onHighWater = move(h); }
+    void OnLowWater(ConnectionHandler h) { handlers.onLowWater = move(h); }
+
+    // keep every accepted connection open on an edge-triggered epoll loop until Stop() is called
+    // use instead of Listen(), Read() and Send()
+    // with threads > 1 each worker gets its own SO_REUSEPORT listener and event loop, the kernel spreads
+    // new connections across them and callbacks run concurrently on the worker threads
+    void Serve(const unsigned threads = 1, const bool pinCpus = false)
+    {
+      try
+      {
+        {
+          lock_guard<mutex> lk(reactorsLock);
+          serving = true;
+          stopping = false;
+        }
+        if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK) < 0) {
+          throw SocketError();
+        }
+        const unsigned n = threads ? threads : 1;
+        if (n > 1 && local.Family() != AF_UNIX) {
+          // the listener bound by the constructor joins the SO_REUSEPORT group of the workers
+          int reuse = 1;
+          if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(int)) < 0) {
+            throw SocketError();
+          }
+        }
+        vector<unique_ptr<Reactor>> loops;
+        loops.push_back(makeReactor(sockfd));
+        for (unsigned i = 1; i < n; i++) {
+          // a Unix socket path binds once, the workers share the listener and race for its connections
+          int fd = local.Family() == AF_UNIX ? fcntl(sockfd, F_DUPFD_CLOEXEC, 0) : bindListener(true);
+          if (fd < 0) {
+            throw SocketError();
+          }
+          workerfds.push_back(fd);
+          if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+            throw SocketError();
+          }
+          loops.push_back(makeReactor(fd));
+        }
+        {
+          lock_guard<mutex> lk(reactorsLock);
+          reactors = move(loops);
+          if (stopping) {
+            for (auto &r : reactors) {
+              r->Stop();
+            }
+          }
+        }
+        TCP_LOG_INFO("Server listening on: " << endpoint() << " (event loop x" << n << ")");
+        listenF = true;
+
+        const unsigned cpus = thread::hardware_concurrency();
+        vector<thread> workers;
+        for (unsigned i = 0; i < n; i++) {
+          // an exception escaping a loop would end the process, a failed worker stops the others instead
+          // so Serve() returns rather than leaving its listener without a loop
+          workers.emplace_back([this, i] ()
+          {
+            try
+            {
+              reactors[i]->Run();
+            }
+            catch (exception& e)
+            {
+              TCP_LOG_ERROR("Server worker " << i << " error: " << e.what());
+              Stop();
+            }
+          });
+          if (pinCpus && cpus) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(i % cpus, &set);
+            pthread_setaffinity_np(workers.back().native_handle(), sizeof set, &set);
+          }
+        }
+        for (auto &w : workers) {
+          w.join();
+        }
+        {
+          lock_guard<mutex> lk(reactorsLock);
+          reactors.clear();
+          serving = stopping = false;
+        }
+        for (int fd : workerfds) {
+          close(fd);
+        }
+        workerfds.clear();
+      }
+      catch (SocketError& e)
+      {
+        TCP_LOG_ERROR("Server Serve Error: " << e.what());
+        closeHandler();
+      }
+    }
+
+    // stop every Serve() worker loop, can be called from any thread or from a callback
+    // a Stop() that comes while Serve() is still starting makes it return once its loops are set up
+    void Stop()
+    {
+      lock_guard<mutex> lk(reactorsLock);
+      stopping = serving;
+      for (auto &r : reactors) {
+        r->Stop();
+      }
+    }
+
     virtual void Close() const
     {
-        if(ServerLoop){
-            close(newsockfd);
+        aio.Detach();
+        if (newsockfd >= 0) {
+          metrics.Disconnected();
+          if (zc.Retire(newsockfd)) {
+            IoLoop::Default().SweepRetired();
+          }
+          close(newsockfd);
+          newsockfd = -1;
         }
-        else{
-            close(newsockfd);
+        if(!ServerLoop && sockfd >= 0){
+            // the file of our own listener, not the one of a live server bind() failed on
+            const char *path = socketPath();
             close(sockfd);
+            sockfd = -1;
+            if (path) {
+              unlink(path);
+            }
         }
     }
 };
@@ -0,0 +1,152 @@
+/*
+ * Source File: socketoptions.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2017 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "logger.h"
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+namespace Tcp {
+
+using namespace std;
+
+/*
+ * Per-socket tuning passed to createServer()/Connect(). Zero or false leaves the kernel default.
+ * Listeners get the buffer sizes and the listener settings before listen() so accepted sockets start
+ * with a matching window, every accepted or connected socket gets the full set.
+ * A setsockopt the kernel refuses (e.g. SO_BUSY_POLL without CAP_NET_ADMIN) is logged and skipped.
+ * Unix domain sockets only get the socket level settings, the TCP ones do not apply to them.
+ */
+struct SocketOptions
+{
+  bool noDelay = true;      // TCP_NODELAY, send small messages now instead of waiting for Nagle
+  bool quickAck = false;    // TCP_QUICKACK, re-armed after every read since the kernel clears it
+  int recvBuffer = 0;       // SO_RCVBUF bytes
+  int sendBuffer = 0;       // SO_SNDBUF bytes
+  int busyPoll = 0;         // SO_BUSY_POLL microseconds spent polling the device queue on a blocking read
+  int userTimeout = 0;      // TCP_USER_TIMEOUT ms unacknowledged data may stay in flight before the connection drops
+  bool keepAlive = false;   // SO_KEEPALIVE with the probe settings below
+  int keepIdle = 30, keepInterval = 10, keepCount = 3;
+  int priority = -1;        // SO_PRIORITY 0-6, queueing priority on the host
+
+  // listener only
+  int backlog = SOMAXCONN;  // listen() queue of handshaken connections, capped by net.core.somaxconn
+  int deferAccept = 0;      // TCP_DEFER_ACCEPT seconds, wake accept only once the client has sent data
+  int fastOpen = 0;         // TCP_FASTOPEN queue length, requests carried in the SYN save a round trip
+
+  // small request/response messages: no Nagle, no delayed ACK
+  static SocketOptions LowLatency()
+  {
+    SocketOptions o;
+    o.quickAck = true;
+    return o;
+  }
+
+  // bulk transfers: Nagle on for full segments, large buffers
+  static SocketOptions Throughput()
+  {
+    SocketOptions o;
+    o.noDelay = false;
+    o.recvBuffer = o.sendBuffer = 4 << 20;
+    return o;
+  }
+
+  // before bind()/connect(), the window scale is negotiated from the receive buffer at that point
+  void Prepare(const int fd) const
+  {
+    if (recvBuffer > 0) {
+      set(fd, SOL_SOCKET, SO_RCVBUF, recvBuffer, "SO_RCVBUF");
+    }
+    if (sendBuffer > 0) {
+      set(fd, SOL_SOCKET, SO_SNDBUF, sendBuffer, "SO_SNDBUF");
+    }
+  }
+
+  // on a listener before listen(), not for protocols where the server speaks first when deferAccept is set
+  void PrepareListener(const int fd) const
+  {
+    Prepare(fd);
+    if (!isTcp(fd)) {
+      return;
+    }
+    if (deferAccept > 0) {
+      set(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, deferAccept, "TCP_DEFER_ACCEPT");
+    }
+    if (fastOpen > 0) {
+      set(fd, IPPROTO_TCP, TCP_FASTOPEN, fastOpen, "TCP_FASTOPEN");
+    }
+  }
+
+  // on every accepted or connected socket
+  void Apply(const int fd) const
+  {
+    Prepare(fd);
+    if (priority >= 0) {
+      set(fd, SOL_SOCKET, SO_PRIORITY, priority, "SO_PRIORITY");
+    }
+    if (busyPoll > 0) {
+      set(fd, SOL_SOCKET, SO_BUSY_POLL, busyPoll, "SO_BUSY_POLL");
+    }
+    if (!isTcp(fd)) {
+      return;
+    }
+    if (noDelay) {
+      set(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+    if (quickAck) {
+      set(fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+    }
+    if (userTimeout > 0) {
+      set(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, userTimeout, "TCP_USER_TIMEOUT");
+    }
+    if (keepAlive) {
+      set(fd, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+      set(fd, IPPROTO_TCP, TCP_KEEPIDLE, keepIdle, "TCP_KEEPIDLE");
+      set(fd, IPPROTO_TCP, TCP_KEEPINTVL, keepInterval, "TCP_KEEPINTVL");
+      set(fd, IPPROTO_TCP, TCP_KEEPCNT, keepCount, "TCP_KEEPCNT");
+    }
+  }
+
+  // after a read, quick ACK mode only lasts until the kernel decides to delay again
+  void Rearm(const int fd) const
+  {
+    if (quickAck) {
+      int on = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof on);
+    }
+  }
+
+  // hold partial segments while a response is built from several sends, Cork(fd, false) pushes them out
+  static void Cork(const int fd, const bool on)
+  {
+    int v = on;
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &v, sizeof v);
+  }
+
+  private:
+    static bool isTcp(const int fd)
+    {
+      int domain = 0;
+      socklen_t len = sizeof domain;
+      return getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) < 0 || domain != AF_UNIX;
+    }
+
+    static void set(const int fd, const int level, const int name, const int value, const char *what)
+    {
+      if (setsockopt(fd, level, name, &value, sizeof value) < 0) {
+        TCP_LOG_WARN("Socket option " << what << " not applied: " << strerror(errno));
+      }
+    }
+};
+
+}
@@ -0,0 +1,166 @@
+/*
+ * Source File: spscqueue.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2017 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <stddef.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace Tcp {
+
+using namespace std;
+
+/*
+ * Bounded lock-free queue for exactly one producer thread and one consumer thread, used to join
+ * pipeline stages. Each side owns one index and only reads the other's, kept on separate cache lines.
+ * A side that has to wait (consumer on empty, producer on full) sleeps on a condition variable, the
+ * other side only takes the lock when it sees that flag, so the hot path stays lock-free.
+ */
+template <typename T>
+class SpscQueue
+{
+  unique_ptr<T[]> items;
+  size_t mask;
+  alignas(64) atomic<size_t> head{0}; // next slot to write, only the producer stores it
+  alignas(64) atomic<size_t> tail{0}; // next slot to read, only the consumer stores it
+  alignas(64) atomic<bool> closed{false};
+  atomic<bool> consumerWaiting{false}, producerWaiting{false};
+  mutex m;
+  condition_variable notEmpty, notFull;
+
+  bool full() const { return head.load(memory_order_relaxed) - tail.load(memory_order_acquire) > mask; }
+
+  // the fence orders the index store before the flag load, the waiter fences between flag and index
+  void wake(atomic<bool> &waiting, condition_variable &cv)
+  {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (waiting.load(memory_order_relaxed)) {
+      lock_guard<mutex> lk(m);
+      cv.notify_one();
+    }
+  }
+
+  public:
+    // capacity is rounded up to a power of two
+    explicit SpscQueue(const size_t capacity = 1024)
+    {
+      size_t n = 2;
+      while (n < capacity) {
+        n <<= 1;
+      }
+      items.reset(new T[n]);
+      mask = n - 1;
+    }
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    size_t Capacity() const { return mask + 1; }
+    size_t Size() const { return head.load(memory_order_acquire) - tail.load(memory_order_acquire); }
+    bool Empty() const { return Size() == 0; }
+
+    // producer: false when the queue is full, v is left untouched then
+    bool TryPush(T &&v)
+    {
+      size_t h = head.load(memory_order_relaxed);
+      if (h - tail.load(memory_order_acquire) > mask) {
+        return false;
+      }
+      items[h & mask] = move(v);
+      head.store(h + 1, memory_order_release);
+      wake(consumerWaiting, notEmpty);
+      return true;
+    }
+
+    // producer: wait for room, this is the back pressure on the stage feeding the queue
+    // false when the queue was closed meanwhile
+    bool Push(T v)
+    {
+      while (!TryPush(move(v))) {
+        unique_lock<mutex> lk(m);
+        producerWaiting.store(true, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (full() && !closed.load(memory_order_acquire)) {
+          notFull.wait(lk);
+        }
+        producerWaiting.store(false, memory_order_relaxed);
+        if (full()) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // consumer: false when the queue is empty
+    bool TryPop(T &v)
+    {
+      size_t t = tail.load(memory_order_relaxed);
+      if (t == head.load(memory_order_acquire)) {
+        return false;
+      }
+      v = move(items[t & mask]);
+      tail.store(t + 1, memory_order_release);
+      wake(producerWaiting, notFull);
+      return true;
+    }
+
+    // consumer: append up to max items to out in one pass, returns how many were taken
+    size_t PopBatch(vector<T> &out, const size_t max)
+    {
+      size_t t = tail.load(memory_order_relaxed);
+      size_t n = head.load(memory_order_acquire) - t;
+      if (n > max) {
+        n = max;
+      }
+      for (size_t i = 0; i < n; i++) {
+        out.push_back(move(items[(t + i) & mask]));
+      }
+      if (n) {
+        tail.store(t + n, memory_order_release);
+        wake(producerWaiting, notFull);
+      }
+      return n;
+    }
+
+    // consumer: wait up to timeout for at least one item, sleeping until a push or Close() wakes it
+    // returns 0 on timeout or once the queue is closed and drained
+    size_t WaitBatch(vector<T> &out, const size_t max, const chrono::milliseconds timeout = chrono::milliseconds(100))
+    {
+      size_t n = PopBatch(out, max);
+      if (n) {
+        return n;
+      }
+      auto deadline = chrono::steady_clock::now() + timeout;
+      {
+        unique_lock<mutex> lk(m);
+        consumerWaiting.store(true, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (Empty() && !closed.load(memory_order_acquire)) {
+          if (notEmpty.wait_until(lk, deadline) == cv_status::timeout) {
+            break;
+          }
+        }
+        consumerWaiting.store(false, memory_order_relaxed);
+      }
+      return PopBatch(out, max);
+    }
+
+    // no more items will be pushed, wakes a waiting consumer once the rest is drained
+    void Close()
+    {
+      lock_guard<mutex> lk(m);
+      closed.store(true, memory_order_release);
+      notEmpty.notify_all();
+      notFull.notify_all();
+    }
+    bool IsClosed() const { return closed.load(memory_order_acquire); }
+};
+
+}
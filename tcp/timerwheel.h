@@ -0,0 +1,223 @@
+/*
+ * Source File: timerwheel.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2017 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+
+namespace Tcp {
+
+using namespace std;
+
+/*
+ * Hierarchical timing wheel with 1 ms ticks: four levels of 64 slots cover 2^24 ms (about 4.6 hours),
+ * longer timers wait in the last level and are re-filed until they are due.
+ * Timers are intrusive list nodes owned by the caller, so Schedule and Cancel are O(1) and allocate nothing.
+ * A timer on a higher level moves down one level when its slot comes up, at most once per level.
+ * Not thread-safe, one wheel per event loop.
+ */
+class TimerWheel
+{
+  public:
+    class Timer
+    {
+      friend class TimerWheel;
+      TimerWheel *wheel = nullptr;
+      Timer *prev = nullptr, *next = nullptr;
+      Timer **head = nullptr; // slot the timer is filed in
+      uint64_t expires = 0;
+      int level = 0;
+
+      public:
+        function<void()> callback;
+
+        Timer() {}
+        explicit Timer(function<void()> cb) : callback{move(cb)} {}
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+        ~Timer() { Cancel(); }
+
+        bool Armed() const { return wheel != nullptr; }
+
+        void Cancel()
+        {
+          if (wheel) {
+            wheel->unlink(*this);
+          }
+        }
+    };
+
+  private:
+    static const int Levels = 4;
+    static const int Bits = 6;
+    static const int Slots = 1 << Bits;
+    static const uint64_t Mask = Slots - 1;
+    static const uint64_t MaxDelta = (uint64_t(1) << (Levels * Bits)) - 1;
+
+    // list heads, a slot is empty when its head is null
+    Timer *slots[Levels][Slots]{};
+    size_t count[Levels]{};
+    uint64_t current = 0; // next tick to process
+    bool advancing = false;
+    chrono::steady_clock::time_point start;
+
+    static uint64_t slotOf(const uint64_t tick, const int level) { return (tick >> (level * Bits)) & Mask; }
+
+    uint64_t ticks(const chrono::steady_clock::time_point t) const
+    {
+      return chrono::duration_cast<chrono::milliseconds>(t - start).count();
+    }
+
+    void link(Timer &t)
+    {
+      // an overdue timer goes to the slot processed next, one beyond the range to the last level
+      uint64_t delta = t.expires > current ? t.expires - current : 0;
+      if (delta > MaxDelta) {
+        delta = MaxDelta;
+      }
+      int level = 0;
+      while (level < Levels - 1 && delta >= (uint64_t(1) << ((level + 1) * Bits))) {
+        level++;
+      }
+      t.level = level;
+      t.head = &slots[level][slotOf(current + delta, level)];
+      t.prev = nullptr;
+      t.next = *t.head;
+      if (t.next) {
+        t.next->prev = &t;
+      }
+      *t.head = &t;
+      t.wheel = this;
+      count[level]++;
+    }
+
+    void unlink(Timer &t)
+    {
+      if (t.prev) {
+        t.prev->next = t.next;
+      }
+      else {
+        *t.head = t.next;
+      }
+      if (t.next) {
+        t.next->prev = t.prev;
+      }
+      t.prev = t.next = nullptr;
+      t.head = nullptr;
+      t.wheel = nullptr;
+      count[t.level]--;
+    }
+
+    // move every timer of a higher level slot down, returns the slot index
+    uint64_t cascade(const int level)
+    {
+      uint64_t idx = slotOf(current, level);
+      Timer *t = slots[level][idx];
+      slots[level][idx] = nullptr;
+      while (t) {
+        Timer *n = t->next;
+        count[level]--;
+        link(*t);
+        t = n;
+      }
+      return idx;
+    }
+
+  public:
+    TimerWheel() : start{chrono::steady_clock::now()} {}
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    virtual ~TimerWheel()
+    {
+      for (int l = 0; l < Levels; l++) {
+        for (auto &head : slots[l]) {
+          while (head) {
+            unlink(*head);
+          }
+        }
+      }
+    }
+
+    // run t.callback after ms milliseconds, an armed timer is moved
+    void Schedule(Timer &t, const uint64_t ms)
+    {
+      t.Cancel();
+      uint64_t e = ticks(chrono::steady_clock::now()) + ms;
+      // from a callback, the tick being processed is already over
+      uint64_t first = advancing ? current + 1 : current;
+      t.expires = e > first ? e : first;
+      link(t);
+    }
+
+    size_t Size() const { return count[0] + count[1] + count[2] + count[3]; }
+    bool Empty() const { return Size() == 0; }
+
+    // milliseconds until the wheel needs Advance() again, -1 when no timer is armed
+    // a wake-up may only move timers down a level without running any
+    int NextTimeout() const
+    {
+      if (Empty()) {
+        return -1;
+      }
+      uint64_t next = UINT64_MAX;
+      for (int l = 0; l < Levels; l++) {
+        if (!count[l]) {
+          continue;
+        }
+        // a slot of level l comes up at the multiples of 2^(l * Bits) not processed yet
+        uint64_t shift = l * Bits;
+        uint64_t first = (current + (uint64_t(1) << shift) - 1) >> shift;
+        for (uint64_t j = 0; j <= Mask; j++) {
+          if (slots[l][(first + j) & Mask]) {
+            next = min(next, (first + j) << shift);
+            break;
+          }
+        }
+      }
+      uint64_t now = ticks(chrono::steady_clock::now());
+      return next <= now ? 0 : static_cast<int>(min<uint64_t>(next - now, INT32_MAX));
+    }
+
+    // run every timer that is due, returns how many ran
+    size_t Advance()
+    {
+      uint64_t now = ticks(chrono::steady_clock::now());
+      size_t ran = 0;
+      advancing = true;
+      while (current <= now) {
+        if (Empty()) {
+          current = now + 1;
+          break;
+        }
+        uint64_t idx = current & Mask;
+        // nothing on level 0 until the next cascade, skip ahead
+        if (!count[0] && idx) {
+          current = min(now + 1, (current | Mask) + 1);
+          continue;
+        }
+        if (!idx) {
+          for (int l = 1; l < Levels && !cascade(l); l++) {}
+        }
+        Timer *t;
+        while ((t = slots[0][idx]) != nullptr) {
+          unlink(*t);
+          ran++;
+          if (t->callback) {
+            // may schedule or cancel any timer, t included
+            t->callback();
+          }
+        }
+        current++;
+      }
+      advancing = false;
+      return ran;
+    }
+};
+
+}
@@ -0,0 +1,898 @@
+/*
+ * Source File: uring.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2017 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include "reactor.h"
+
+// io_uring needs kernel headers with multishot accept/recv and provided buffer rings (Linux 6.0+),
+// define TCP_NO_IO_URING to leave it out of the build entirely
+#if !defined(TCP_NO_IO_URING) && defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT) && defined(__NR_io_uring_setup)
+#define TCP_HAVE_IO_URING 1
+#endif
+
+#ifdef TCP_HAVE_IO_URING
+
+namespace Tcp {
+
+using namespace std;
+
+// minimal io_uring instance over the raw syscalls, one per event loop thread
+class Uring
+{
+  int ringfd = -1;
+  void *ringPtr = MAP_FAILED, *sqePtr = MAP_FAILED;
+  size_t ringLen = 0, sqeLen = 0;
+  unsigned *sqHead, *sqTail, *sqMask, *sqArray, sqEntries;
+  unsigned *cqHead, *cqTail, *cqMask;
+  io_uring_sqe *sqes;
+  io_uring_cqe *cqes;
+  unsigned localTail = 0;
+
+  static int setup(const unsigned entries, io_uring_params &p)
+  {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+  }
+
+  public:
+    explicit Uring(const unsigned entries = 4096)
+    {
+      io_uring_params p{};
+      p.flags = IORING_SETUP_SUBMIT_ALL;
+      ringfd = setup(entries, p);
+      if (ringfd < 0 && errno == EINVAL) {
+        p = io_uring_params{};
+        ringfd = setup(entries, p);
+      }
+      if (ringfd < 0) {
+        throw SocketError();
+      }
+      if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ringfd);
+        throw SocketError("io_uring kernel support is too old");
+      }
+      ringLen = max(p.sq_off.array + p.sq_entries * sizeof(unsigned), p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe));
+      ringPtr = mmap(nullptr, ringLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+      sqeLen = p.sq_entries * sizeof(io_uring_sqe);
+      sqePtr = mmap(nullptr, sqeLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES);
+      if (ringPtr == MAP_FAILED || sqePtr == MAP_FAILED) {
+        int e = errno;
+        this->~Uring();
+        errno = e;
+        throw SocketError();
+      }
+      char *r = static_cast<char*>(ringPtr);
+      sqHead = reinterpret_cast<unsigned*>(r + p.sq_off.head);
+      sqTail = reinterpret_cast<unsigned*>(r + p.sq_off.tail);
+      sqMask = reinterpret_cast<unsigned*>(r + p.sq_off.ring_mask);
+      sqArray = reinterpret_cast<unsigned*>(r + p.sq_off.array);
+      sqEntries = p.sq_entries;
+      cqHead = reinterpret_cast<unsigned*>(r + p.cq_off.head);
+      cqTail = reinterpret_cast<unsigned*>(r + p.cq_off.tail);
+      cqMask = reinterpret_cast<unsigned*>(r + p.cq_off.ring_mask);
+      cqes = reinterpret_cast<io_uring_cqe*>(r + p.cq_off.cqes);
+      sqes = static_cast<io_uring_sqe*>(sqePtr);
+      localTail = *sqTail;
+    }
+    Uring(const Uring&) = delete;
+    Uring& operator=(const Uring&) = delete;
+
+    ~Uring()
+    {
+      if (sqePtr != MAP_FAILED) {
+        munmap(sqePtr, sqeLen);
+      }
+      if (ringPtr != MAP_FAILED) {
+        munmap(ringPtr, ringLen);
+      }
+      if (ringfd >= 0) {
+        close(ringfd);
+      }
+    }
+
+    int Fd() const { return ringfd; }
+
+    // next free submission entry, zeroed; submits the queue first when it is full
+    io_uring_sqe* Sqe()
+    {
+      if (localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+        Submit();
+      }
+      unsigned idx = localTail & *sqMask;
+      sqArray[idx] = idx;
+      localTail++;
+      io_uring_sqe *sqe = &sqes[idx];
+      memset(sqe, 0, sizeof *sqe);
+      return sqe;
+    }
+
+    // hand every prepared entry to the kernel in one syscall, optionally waiting for waitNr completions
+    // but no longer than timeout milliseconds (-1 waits as long as it takes)
+    int Submit(const unsigned waitNr = 0, const int timeout = -1)
+    {
+      __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+      unsigned n = localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+      if (!n && !waitNr) {
+        return 0;
+      }
+      unsigned flags = waitNr ? IORING_ENTER_GETEVENTS : 0;
+      __kernel_timespec ts{timeout / 1000, (timeout % 1000) * 1000000LL};
+      io_uring_getevents_arg arg{};
+      void *argp = nullptr;
+      size_t argLen = 0;
+      if (waitNr && timeout >= 0) {
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argLen = sizeof arg;
+      }
+      int r;
+      do {
+        r = static_cast<int>(syscall(__NR_io_uring_enter, ringfd, n, waitNr, flags, argp, argLen));
+      } while (r < 0 && errno == EINTR);
+      if (r < 0 && errno != EAGAIN && errno != EBUSY && errno != ETIME) {
+        throw SocketError();
+      }
+      return r;
+    }
+
+    // call f(const io_uring_cqe&) for every completion available now, returns how many
+    template <typename F>
+    unsigned Complete(F f)
+    {
+      unsigned head = *cqHead, count = 0;
+      unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+      while (head != tail) {
+        io_uring_cqe cqe = cqes[head & *cqMask];
+        head++;
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        f(cqe);
+        count++;
+        if (head == tail) {
+          tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        }
+      }
+      return count;
+    }
+
+    int Register(const unsigned opcode, void *arg, const unsigned nr)
+    {
+      return static_cast<int>(syscall(__NR_io_uring_register, ringfd, opcode, arg, nr));
+    }
+
+    // whether the kernel knows an opcode (IORING_REGISTER_PROBE, Linux 5.6+), its flags are not covered
+    bool Supports(const unsigned op)
+    {
+      const unsigned n = 256;
+      vector<io_uring_probe_op> buf(n + sizeof(io_uring_probe) / sizeof(io_uring_probe_op));
+      io_uring_probe *p = reinterpret_cast<io_uring_probe*>(buf.data());
+      if (Register(IORING_REGISTER_PROBE, p, n) < 0) {
+        return false;
+      }
+      return op <= p->last_op && (p->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+};
+
+/*
+ * Provided buffers, the kernel picks a free one for each multishot recv completion.
+ * Uses a registered buffer ring and falls back to IORING_OP_PROVIDE_BUFFERS when the kernel
+ * accepts the ring but does not hand out its buffers (probed once at startup).
+ */
+class BufferRing
+{
+  Uring &ring;
+  unsigned short bgid, tail = 0;
+  unsigned entries, size;
+  io_uring_buf_ring *br = nullptr;
+  size_t brLen;
+  vector<char> storage;
+
+  void unregister()
+  {
+    io_uring_buf_reg reg{};
+    reg.bgid = bgid;
+    ring.Register(IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(br, brLen);
+    br = nullptr;
+  }
+
+  // receive one byte from a socketpair through the group, true if the ring handed out a buffer
+  bool probe()
+  {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+      return false;
+    }
+    char c = 0;
+    ssize_t w = write(sv[1], &c, 1);
+    (void)w;
+    io_uring_sqe *sqe = ring.Sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sv[0];
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bgid;
+    sqe->user_data = UserData;
+    ring.Submit(1);
+    bool ok = false;
+    ring.Complete([&] (const io_uring_cqe &cqe)
+    {
+      if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+        ok = true;
+        Recycle(static_cast<unsigned short>(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+      }
+    });
+    close(sv[0]);
+    close(sv[1]);
+    return ok;
+  }
+
+  public:
+    // user_data of the buffer submissions, completions carrying it can be ignored
+    static const uint64_t UserData = 3;
+
+    BufferRing(Uring &ring, const unsigned short bgid, const unsigned entries = 1024, const unsigned size = 4096)
+      : ring(ring), bgid{bgid}, entries{entries}, size{size}, storage(size_t(entries) * size)
+    {
+      brLen = entries * sizeof(io_uring_buf);
+      void *p = mmap(nullptr, brLen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p != MAP_FAILED) {
+        br = static_cast<io_uring_buf_ring*>(p);
+        io_uring_buf_reg reg{};
+        reg.ring_addr = reinterpret_cast<uint64_t>(br);
+        reg.ring_entries = entries;
+        reg.bgid = bgid;
+        if (ring.Register(IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+          munmap(br, brLen);
+          br = nullptr;
+        }
+      }
+      if (br) {
+        for (unsigned i = 0; i < entries; i++) {
+          Recycle(static_cast<unsigned short>(i));
+        }
+        if (!probe()) {
+          unregister();
+        }
+      }
+      if (!br) {
+        io_uring_sqe *sqe = ring.Sqe();
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = static_cast<int>(entries);
+        sqe->addr = reinterpret_cast<uint64_t>(storage.data());
+        sqe->len = size;
+        sqe->buf_group = bgid;
+        sqe->user_data = UserData;
+        ring.Submit(1);
+        int res = -EINVAL;
+        ring.Complete([&res] (const io_uring_cqe &cqe) { res = cqe.res; });
+        if (res < 0) {
+          errno = -res;
+          throw SocketError();
+        }
+      }
+    }
+    BufferRing(const BufferRing&) = delete;
+    BufferRing& operator=(const BufferRing&) = delete;
+
+    ~BufferRing()
+    {
+      if (br) {
+        unregister();
+      }
+    }
+
+    unsigned short Group() const { return bgid; }
+    const char* Data(const unsigned short bid) const { return storage.data() + size_t(bid) * size; }
+
+    // give a consumed buffer back to the kernel, in classic mode it goes out with the next submit
+    void Recycle(const unsigned short bid)
+    {
+      if (br) {
+        io_uring_buf &b = br->bufs[tail & (entries - 1)];
+        b.addr = reinterpret_cast<uint64_t>(Data(bid));
+        b.len = size;
+        b.bid = bid;
+        tail++;
+        __atomic_store_n(&br->tail, tail, __ATOMIC_RELEASE);
+        return;
+      }
+      io_uring_sqe *sqe = ring.Sqe();
+      sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+      sqe->fd = 1;
+      sqe->addr = reinterpret_cast<uint64_t>(Data(bid));
+      sqe->len = size;
+      sqe->off = bid;
+      sqe->buf_group = bgid;
+      sqe->user_data = UserData;
+    }
+};
+
+class UringReactor;
+
+/*
+ * Connection whose data arrives through multishot recv completions and whose sends are
+ * collected during a batch of events and submitted together. Same Read/Send semantics as the epoll path,
+ * and as there a response sent right before Close() still goes out: the queued sends are submitted and
+ * the socket is shut down after the last one completes, or after the write timeout (5 s without one).
+ */
+class UringConnection : public Connection
+{
+  friend class UringReactor;
+  UringReactor &reactor;
+  string in, sending, queued;
+  size_t inpos = 0, sent = 0;
+  int inflight = 0;
+  bool eof = false, sendArmed = false, recvArmed = false, released = false;
+  // bounds the sends of a closed connection
+  TimerWheel::Timer linger;
+
+  void schedule();
+  void hangUp();
+
+  public:
+    UringConnection(const int fd, EventLoop &loop, const sockaddr_storage &peer, function<void(int)> release, UringReactor &reactor, Metrics *metrics)
+      : Connection(fd, loop, peer, move(release), metrics), reactor(reactor), linger([this] { hangUp(); }) {}
+
+    string Read() override
+    {
+      string d;
+      if (inpos) {
+        d.assign(in, inpos, string::npos);
+      }
+      else {
+        d.swap(in);
+      }
+      in.clear();
+      inpos = 0;
+      if (d.empty() && eof) {
+        Close();
+      }
+      return d;
+    }
+
+    ssize_t Read(char *buf, const size_t len) override
+    {
+      if (inpos == in.size()) {
+        if (eof || closed) {
+          Close();
+          return 0;
+        }
+        errno = EAGAIN;
+        return -1;
+      }
+      size_t n = min(len, in.size() - inpos);
+      memcpy(buf, in.data() + inpos, n);
+      inpos += n;
+      if (inpos == in.size()) {
+        in.clear();
+        inpos = 0;
+      }
+      return n;
+    }
+
+    ssize_t Send(const char *data, const size_t len) override
+    {
+      if (closed) {
+        return -1;
+      }
+      queued.append(data, len);
+      schedule();
+      watchWrite(false);
+      checkWater();
+      return len;
+    }
+
+    void Flush() override {}
+
+    // sends go through the ring, MSG_ZEROCOPY is only available on the epoll backend
+    bool EnableZeroCopy(const size_t) override { return false; }
+
+    // cancels the multishot recv, received data waits in the connection until reading resumes
+    void PauseReading() override;
+    void ResumeReading() override;
+
+    size_t Pending() const override { return sending.size() - sent + queued.size(); }
+
+    // stops reading, sends what is queued, then shutdown ends the outstanding operations
+    // and the socket is released once they have completed
+    void Close() override;
+};
+
+/*
+ * io_uring backend for Serve(): one multishot accept, one multishot recv per connection backed by a
+ * provided buffer ring, and all sends of a batch submitted with a single io_uring_enter.
+ * The loop thread waits in io_uring_enter, completions are only delivered to the thread that submitted
+ * them while it is inside the kernel. The event loop's epoll fd is watched by a multishot poll, so
+ * Defer/Post/Stop behave as on the epoll path, epoll_wait only runs after that poll reported it.
+ * Only Serve() uses io_uring: Read/ReadAsync/Send and the futures of Server and Client keep
+ * their poll + recv/send calls on either backend.
+ */
+class UringReactor : public Reactor
+{
+  friend class UringConnection;
+  // low bits of user_data, the rest is the UringConnection pointer (3 is taken by BufferRing)
+  enum : uint64_t { OpRecv = 0, OpSend = 1, OpAccept = 2, OpPoll = 4, OpCancel = 5, OpProbe = 6, OpMask = 7 };
+
+  static const int LingerMs = 5000;
+
+  Uring ring;
+  BufferRing bufs;
+  vector<shared_ptr<UringConnection>> dirty;
+  bool epollReady = false; // the poll on the loop's epoll fd completed since the last epoll_wait
+  // set by Stop() and never cleared, a Stop() that arrives before Run() is not lost
+  atomic<bool> stopped{false};
+
+  // submit the prepared probe and wait for its first completion, a request that stays armed
+  // is cancelled and waited for as well
+  int runProbe(bool &more)
+  {
+    int res = -ETIME;
+    bool armed = true;
+    more = false;
+    for (int i = 0; armed && i < 10; i++) {
+      ring.Submit(1, 100);
+      ring.Complete([&] (const io_uring_cqe &cqe)
+      {
+        if (cqe.user_data != OpProbe) {
+          return;
+        }
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+          bufs.Recycle(static_cast<unsigned short>(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+        }
+        armed = cqe.flags & IORING_CQE_F_MORE;
+        if (res == -ETIME) {
+          res = cqe.res;
+          more = armed;
+          if (armed) {
+            io_uring_sqe *sqe = ring.Sqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = OpProbe;
+            sqe->user_data = OpCancel;
+          }
+        }
+      });
+    }
+    return res;
+  }
+
+  // the flags cannot be probed, so accept one connection on a throwaway abstract Unix socket and
+  // receive a byte on it; kernels without multishot fail with EINVAL or end the request at once
+  bool probeMultishot()
+  {
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int cfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    sockaddr_un a{};
+    a.sun_family = AF_UNIX;
+    socklen_t len = sizeof(sa_family_t); // autobind
+    bool ok = lfd >= 0 && cfd >= 0 && bind(lfd, (struct sockaddr *) &a, len) == 0 && listen(lfd, 1) == 0;
+    if (ok) {
+      len = sizeof a;
+      ok = getsockname(lfd, (struct sockaddr *) &a, &len) == 0 && connect(cfd, (struct sockaddr *) &a, len) == 0 && write(cfd, "x", 1) == 1;
+    }
+    bool more = false;
+    int afd = -1;
+    if (ok) {
+      io_uring_sqe *sqe = ring.Sqe();
+      sqe->opcode = IORING_OP_ACCEPT;
+      sqe->fd = lfd;
+      sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+      sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+      sqe->user_data = OpProbe;
+      afd = runProbe(more);
+      ok = afd >= 0 && more;
+    }
+    if (ok) {
+      io_uring_sqe *sqe = ring.Sqe();
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd = afd;
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = bufs.Group();
+      sqe->user_data = OpProbe;
+      ok = runProbe(more) == 1 && more;
+    }
+    for (int fd : {afd, cfd, lfd}) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+    return ok;
+  }
+
+  void armPoll()
+  {
+    io_uring_sqe *sqe = ring.Sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = loop.Fd();
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = OpPoll;
+  }
+
+  void armAccept()
+  {
+    io_uring_sqe *sqe = ring.Sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = OpAccept;
+  }
+
+  void armRecv(UringConnection &c)
+  {
+    io_uring_sqe *sqe = ring.Sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c.fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bufs.Group();
+    sqe->user_data = reinterpret_cast<uint64_t>(&c) | OpRecv;
+    c.recvArmed = true;
+    c.inflight++;
+  }
+
+  // ends the multishot recv, its last completion comes back with -ECANCELED
+  void cancelRecv(UringConnection &c)
+  {
+    if (!c.recvArmed) {
+      return;
+    }
+    io_uring_sqe *sqe = ring.Sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = reinterpret_cast<uint64_t>(&c) | OpRecv;
+    sqe->user_data = OpCancel;
+  }
+
+  // re-arm the recv of a resumed connection and hand it what arrived before the cancel took effect
+  void resumeRecv(UringConnection &c)
+  {
+    if (!c.recvArmed && !c.eof) {
+      armRecv(c);
+    }
+    if (!c.in.empty() || c.eof) {
+      auto self = static_pointer_cast<UringConnection>(c.shared_from_this());
+      loop.Defer([this, self]
+      {
+        if (!self->closed && !self->paused) {
+          deliver(*self);
+        }
+      });
+    }
+  }
+
+  void deliver(UringConnection &c)
+  {
+    if (handlers.onRead) {
+      serve(c);
+    }
+    else {
+      c.Read();
+    }
+    if (c.eof && !c.closed) {
+      c.Close();
+    }
+  }
+
+  void armSend(UringConnection &c)
+  {
+    if (c.sent == c.sending.size()) {
+      c.sending.clear();
+      c.sent = 0;
+      if (c.queued.empty()) {
+        return;
+      }
+      c.sending.swap(c.queued);
+    }
+    io_uring_sqe *sqe = ring.Sqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(c.sending.data() + c.sent);
+    sqe->len = static_cast<unsigned>(c.sending.size() - c.sent);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = reinterpret_cast<uint64_t>(&c) | OpSend;
+    c.sendArmed = true;
+    c.inflight++;
+  }
+
+  void schedule(UringConnection &c)
+  {
+    if (c.sendArmed) {
+      return;
+    }
+    if (dirty.empty()) {
+      loop.Defer([this] { flushSends(); });
+    }
+    dirty.push_back(static_pointer_cast<UringConnection>(c.shared_from_this()));
+  }
+
+  // sends of a closed connection, the recv is cancelled and the socket is shut down after the last
+  // send completed or the linger timer gave up on the peer
+  void drain(UringConnection &c)
+  {
+    cancelRecv(c);
+    if (!c.sendArmed) {
+      armSend(c);
+    }
+    if (!c.sendArmed) {
+      shutdown(c.fd, SHUT_RDWR);
+      finish(c);
+      return;
+    }
+    loop.Timers().Schedule(c.linger, c.writeTimeout ? c.writeTimeout : LingerMs);
+  }
+
+  // drop whatever is still queued and end the outstanding operations
+  void hangUp(UringConnection &c)
+  {
+    c.linger.Cancel();
+    c.queued.clear();
+    shutdown(c.fd, SHUT_RDWR);
+    finish(c);
+  }
+
+  void flushSends()
+  {
+    for (auto &c : dirty) {
+      if (!c->closed && !c->sendArmed) {
+        armSend(*c);
+      }
+    }
+    dirty.clear();
+    ring.Submit();
+  }
+
+  void finish(UringConnection &c)
+  {
+    if (c.closed && !c.inflight && !c.released) {
+      c.released = true;
+      c.linger.Cancel();
+      int fd = c.fd;
+      loop.Defer([this, fd] { release(fd); });
+    }
+  }
+
+  void accepted(const int fd)
+  {
+    sockaddr_storage peer{};
+    socklen_t len = sizeof peer;
+    getpeername(fd, (struct sockaddr *) &peer, &len);
+    if (metrics) {
+      metrics->Accepted();
+    }
+    if (!admit(fd)) {
+      return;
+    }
+    opts.Apply(fd);
+    auto conn = allocate_shared<UringConnection>(PoolAllocator<UringConnection>(), fd, loop, peer, [this] (int fd) { release(fd); }, *this, metrics);
+    conns[fd] = conn;
+    armRecv(*conn);
+    setup(*conn);
+    if (handlers.onConnect) {
+      invoke(handlers.onConnect, *conn);
+    }
+  }
+
+  void received(UringConnection &c, const io_uring_cqe &cqe)
+  {
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+      c.inflight--;
+      c.recvArmed = false;
+    }
+    if (cqe.res == -ECANCELED) {
+      // reading may have resumed before the cancel took effect
+      if (!c.closed && !c.paused) {
+        resumeRecv(c);
+      }
+      finish(c);
+      return;
+    }
+    if (cqe.res < 0) {
+      errno = -cqe.res;
+    }
+    c.countRecv(cqe.res);
+    if (cqe.res > 0) {
+      unsigned short bid = static_cast<unsigned short>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+      c.in.append(bufs.Data(bid), cqe.res);
+      bufs.Recycle(bid);
+    }
+    else if (cqe.res != -ENOBUFS) {
+      c.eof = true;
+    }
+    if (!c.closed && !c.paused) {
+      deliver(c);
+    }
+    // multishot stops when the buffer ring runs dry, re-arm it
+    if (!(cqe.flags & IORING_CQE_F_MORE) && !c.closed && !c.eof && !c.paused) {
+      armRecv(c);
+    }
+    finish(c);
+  }
+
+  void written(UringConnection &c, const io_uring_cqe &cqe)
+  {
+    c.inflight--;
+    c.sendArmed = false;
+    if (cqe.res >= 0) {
+      c.sent += cqe.res;
+    }
+    c.countSend(cqe.res);
+    if (cqe.res < 0) {
+      // nothing queued can reach the peer any more
+      c.sending.clear();
+      c.sent = 0;
+      c.queued.clear();
+      if (!c.closed) {
+        c.Close();
+      }
+      else {
+        hangUp(c);
+      }
+    }
+    else if (!c.closed) {
+      armSend(c);
+      if (!c.sendArmed && handlers.onWrite) {
+        invoke(handlers.onWrite, c);
+      }
+    }
+    else if (c.linger.Armed()) {
+      // draining after Close()
+      armSend(c);
+      if (!c.sendArmed) {
+        hangUp(c);
+      }
+    }
+    finish(c);
+  }
+
+  void complete()
+  {
+    ring.Complete([this] (const io_uring_cqe &cqe)
+    {
+      uint64_t op = cqe.user_data & OpMask;
+      if (cqe.user_data == BufferRing::UserData || op == OpCancel || op == OpProbe) {
+        return;
+      }
+      if (op == OpPoll) {
+        // the event loop runs after this batch, just keep watching it
+        epollReady = true;
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+          armPoll();
+        }
+        return;
+      }
+      if (op == OpAccept) {
+        if (cqe.res >= 0) {
+          accepted(cqe.res);
+        }
+        else if (cqe.flags & IORING_CQE_F_MORE) {
+          if (metrics) {
+            metrics->Error();
+          }
+        }
+        // a failed accept ends the multishot, EMFILE and friends are retried on a timer as with epoll
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+          if (cqe.res < 0 && cqe.res != -ECONNABORTED && cqe.res != -EINTR && cqe.res != -EAGAIN) {
+            acceptLater(-cqe.res);
+          }
+          else {
+            armAccept();
+          }
+        }
+        return;
+      }
+      UringConnection &c = *reinterpret_cast<UringConnection*>(cqe.user_data & ~uint64_t(OpMask));
+      if (op == OpRecv) {
+        received(c, cqe);
+      }
+      else {
+        written(c, cqe);
+      }
+    });
+  }
+
+  public:
+    UringReactor(const int listenfd, const ConnectionHandlers &handlers, Metrics *metrics = nullptr, const unsigned entries = 4096)
+      : Reactor(handlers, metrics), ring(entries), bufs(ring, 0)
+    {
+      const unsigned ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL };
+      for (unsigned op : ops) {
+        if (!ring.Supports(op)) {
+          throw SocketError("io_uring kernel support is too old");
+        }
+      }
+      if (!probeMultishot()) {
+        throw SocketError("io_uring multishot accept and recv are not supported");
+      }
+      this->listenfd = listenfd;
+      acceptRetry.callback = [this] { armAccept(); };
+    }
+
+    void Run() override
+    {
+      armPoll();
+      armAccept();
+      while (!stopped) {
+        complete();
+        // epoll events, deferred and posted tasks, the deferred flushSends submits the batch of sends
+        // epoll_wait only when the poll fired, or when the last one filled its batch and more may be ready
+        if (epollReady) {
+          epollReady = static_cast<size_t>(loop.RunOnce(0)) == loop.MaxEvents();
+        }
+        else {
+          loop.RunPending();
+        }
+        if (!stopped) {
+          // wake up in time for the next timer of the loop
+          ring.Submit(1, loop.Timers().NextTimeout());
+        }
+      }
+    }
+
+    void Stop() override
+    {
+      stopped = true;
+      loop.Stop();
+    }
+};
+
+inline void UringConnection::schedule()
+{
+  reactor.schedule(*this);
+}
+
+inline void UringConnection::hangUp()
+{
+  reactor.hangUp(*this);
+}
+
+inline void UringConnection::PauseReading()
+{
+  if (paused || closed) {
+    return;
+  }
+  paused = true;
+  reactor.cancelRecv(*this);
+}
+
+inline void UringConnection::ResumeReading()
+{
+  if (!paused || closed) {
+    return;
+  }
+  paused = false;
+  reactor.resumeRecv(*this);
+}
+
+inline void UringConnection::Close()
+{
+  if (closed) {
+    return;
+  }
+  closed = true;
+  cancelTimers();
+  reactor.drain(*this);
+}
+
+}
+
+#endif
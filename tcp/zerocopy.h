@@ -0,0 +1,272 @@
+/*
+ * Source File: zerocopy.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2017 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "logger.h"
+#include "result.h"
+#include "pool.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+namespace Tcp {
+
+using namespace std;
+
+/*
+ * MSG_ZEROCOPY sends of one socket. The kernel transmits straight from the caller's pages, so every
+ * buffer is held by a shared_ptr until the completion for its send calls arrives on the error queue.
+ * Those completions raise POLLERR/EPOLLERR, Reap() them whenever the socket reports an error.
+ * When the kernel reports that it had to copy anyway (loopback, devices without scatter-gather)
+ * the pinning only costs extra work, so zero-copy switches itself off for the socket.
+ * Retire() the socket before closing it, buffers still in flight then outlive the descriptor until
+ * a later Sweep() finds them released, IoLoop::SweepRetired() runs it on a timer.
+ */
+class ZeroCopy
+{
+  struct Entry
+  {
+    uint32_t id;
+    shared_ptr<const string> buf;
+  };
+  using Queue = deque<Entry, PoolAllocator<Entry>>;
+
+  // a closed socket kept open on a duplicate descriptor until the kernel released its buffers
+  struct Retired
+  {
+    int fd;
+    Queue inflight;
+  };
+
+  struct Graveyard
+  {
+    mutex lock;
+    vector<Retired> socks;
+  };
+
+  bool enabled = false;
+  size_t threshold = 32768;
+  uint32_t next = 0;   // id the kernel gives the next successful zero-copy send call
+  Queue inflight;
+  uint64_t completed = 0, copied = 0;
+
+  // never destroyed, sockets may be retired during exit
+  static Graveyard& graveyard()
+  {
+    static Graveyard *g = new Graveyard;
+    return *g;
+  }
+
+  // read every notice queued on fd, drop the buffers of q the kernel released and pass each
+  // completed range to done(count, copied), returns how many buffers were dropped
+  template <class F>
+  static size_t collect(const int fd, Queue &q, F done)
+  {
+    size_t dropped = 0;
+    for (;;) {
+      char control[128];
+      msghdr m{};
+      m.msg_control = control;
+      m.msg_controllen = sizeof control;
+      if (recvmsg(fd, &m, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+        return dropped;
+      }
+      for (cmsghdr *c = CMSG_FIRSTHDR(&m); c; c = CMSG_NXTHDR(&m, c)) {
+        if (!(c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR) && !(c->cmsg_level == SOL_IPV6 && c->cmsg_type == IPV6_RECVERR)) {
+          continue;
+        }
+        auto ee = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(c));
+        if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+          continue;
+        }
+        // ids ee_info..ee_data completed, ranges wrap around at 2^32
+        uint32_t lo = ee->ee_info, span = ee->ee_data - lo;
+        for (auto it = q.begin(); it != q.end();) {
+          if (it->id - lo <= span) {
+            it = q.erase(it);
+            dropped++;
+          }
+          else {
+            ++it;
+          }
+        }
+        done(span + 1, (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0);
+      }
+    }
+  }
+
+  // close the retired sockets whose buffers are all released
+  static void sweep(Graveyard &g)
+  {
+    for (auto it = g.socks.begin(); it != g.socks.end();) {
+      collect(it->fd, it->inflight, [] (const uint32_t, const bool) {});
+      if (it->inflight.empty()) {
+        close(it->fd);
+        it = g.socks.erase(it);
+      }
+      else {
+        ++it;
+      }
+    }
+  }
+
+  public:
+    // SO_ZEROCOPY on fd, false when the kernel refuses it (then Send() is never used)
+    // payloads of at least threshold bytes go zero-copy, below it copying is cheaper than pinning pages
+    bool Enable(const int fd, const size_t minSize = 32768)
+    {
+      int on = 1;
+      threshold = minSize;
+      enabled = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof on) == 0;
+      if (!enabled) {
+        TCP_LOG_WARN("SO_ZEROCOPY not applied: " << strerror(errno));
+      }
+      return enabled;
+    }
+
+    bool Enabled() const { return enabled; }
+    // completions may still arrive on the error queue
+    bool Used() const { return enabled || !inflight.empty(); }
+    // a payload of len bytes should take the zero-copy path
+    bool Wants(const size_t len) const { return enabled && len >= threshold; }
+    size_t InFlight() const { return inflight.size(); }
+    uint64_t Completed() const { return completed; }
+    uint64_t Copied() const { return copied; }
+
+    // one send of len bytes at data, which must lie inside buf, zero-copy while enabled
+    // returns bytes sent, 0 when it would block (or the kernel is out of optmem), -1 on a hard error
+    ssize_t Send(const int fd, const shared_ptr<const string> &buf, const char *data, const size_t len)
+    {
+      ssize_t n;
+      do {
+        n = send(fd, data, len, MSG_NOSIGNAL | (enabled ? MSG_ZEROCOPY : 0));
+      } while (n < 0 && errno == EINTR);
+      if (n < 0) {
+        // ENOBUFS: the socket's pinned page budget is used up, wait for completions like for EAGAIN
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS ? 0 : -1;
+      }
+      if (enabled) {
+        inflight.push_back(Entry{next++, buf});
+      }
+      return n;
+    }
+
+    // all of buf on a blocking-style connection, polling up to timeout ms (-1 forever) for writability
+    // sent(n) counts every send, Ok with the bytes written, Timeout, or Error with errno
+    template <class F>
+    IoResult SendAll(const int fd, const shared_ptr<const string> &buf, const int timeout, F sent)
+    {
+      auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout);
+      size_t off = 0;
+      Reap(fd);
+      while (off < buf->size()) {
+        ssize_t n = sent(Send(fd, buf, buf->data() + off, buf->size() - off));
+        if (n < 0) {
+          return IoResult::FromErrno(errno);
+        }
+        off += n;
+        if (off == buf->size()) {
+          break;
+        }
+        int wait = -1;
+        if (timeout >= 0) {
+          auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+          wait = left > 0 ? static_cast<int>(left) : 0;
+        }
+        IoResult p = PollFor(fd, POLLOUT, wait);
+        if (!p) {
+          return IoResult(p.status, off, p.error);
+        }
+        // POLLERR from pending completions ends the wait as well, and releases pinned pages
+        Reap(fd);
+      }
+      return IoResult(IoResult::Ok, off);
+    }
+
+    // read every completion queued on fd and drop the buffers the kernel released, returns how many
+    size_t Reap(const int fd)
+    {
+      return collect(fd, inflight, [this] (const uint32_t n, const bool copy)
+      {
+        completed += n;
+        if (copy) {
+          copied += n;
+          if (enabled) {
+            enabled = false;
+            TCP_LOG_DEBUG("zero-copy send was copied by the kernel, using regular sends");
+          }
+        }
+      });
+    }
+
+    // call right before fd is closed or replaced, then start over for the next socket
+    // the kernel may still transmit from buffers in flight, so their socket stays open on a
+    // duplicate descriptor, with its write side shut down, until the completions arrive
+    // returns true when fd was kept that way, Sweep() it later; a socket that never used zero-copy
+    // returns right away without the process wide lock
+    bool Retire(const int fd)
+    {
+      if (!Used()) {
+        *this = ZeroCopy();
+        return false;
+      }
+      bool kept = false;
+      if (fd >= 0 && !inflight.empty()) {
+        Reap(fd);
+      }
+      if (!inflight.empty()) {
+        int d = fd >= 0 ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : -1;
+        if (d < 0) {
+          TCP_LOG_WARN("zero-copy buffers of a closed socket are kept for good: " << strerror(fd >= 0 ? errno : EBADF));
+          new Queue(move(inflight));
+        }
+        else {
+          shutdown(d, SHUT_WR);
+          Graveyard &g = graveyard();
+          lock_guard<mutex> lk(g.lock);
+          g.socks.push_back(Retired{d, move(inflight)});
+          kept = true;
+        }
+      }
+      *this = ZeroCopy();
+      return kept;
+    }
+
+    // close the retired sockets whose buffers the kernel released, true while some are still waiting
+    static bool Sweep()
+    {
+      Graveyard &g = graveyard();
+      lock_guard<mutex> lk(g.lock);
+      sweep(g);
+      return !g.socks.empty();
+    }
+};
+
+}